@@ -24,12 +24,38 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <map>
+#include <set>
+#include <list>
+#include <iomanip>
+#include <fstream>
 #include <stdexcept>    // for std::runtime_error
 #include <stdlib.h>     // getenv, _putenv
+#include <string.h>     // strlen
+#include <ctype.h>      // tolower
+#include <stdio.h>      // sprintf
+#include <errno.h>      // errno
+#include <time.h>       // time
+#include <sys/types.h>
+#include <sys/stat.h>   // stat
+#ifdef _WIN32
 #include <process.h>    // _spawnvp
+#else
+#include <unistd.h>     // execvp
+#include <strings.h>    // strcasecmp
+#include <fcntl.h>      // open
+#include <sys/mman.h>   // mmap
+#include <dirent.h>     // opendir
+#include <sys/wait.h>   // waitpid
+#include <sys/time.h>   // gettimeofday
+#include <signal.h>     // raise
+#include <poll.h>       // poll
+#endif
 
 /* headers from other modules ------------------------------------------------*/
+#ifdef _WIN32
 #include <windows.h>
+#endif
 
 
 /*-----------------------------------------------------------------------------+
@@ -42,16 +68,364 @@ using std::endl;
 using std::string;
 using std::vector;
 using std::runtime_error;
+using std::list;
 
 /*-----------------------------------------------------------------------------+
 |   local constants, macros and enums                                          |
 +-----------------------------------------------------------------------------*/
 
+#ifndef _WIN32
+// without the registry only the snapshot files can be used, and these
+// need little of the Windows API
+typedef unsigned long DWORD;
+#define _stricmp strcasecmp
+#define _strnicmp strncasecmp
+
+extern char** environ;
+#endif
+
+// the search lists the toolchains put their directories in front of
+const char* const searchLists[] = { "INCLUDE", "LIB", "LIBPATH", "PATH" };
+
+// the inherited variables --hermetic passes on to the command
+#ifdef _WIN32
+const char* const hermeticVars[] = { "SystemRoot", "SystemDrive", "windir",
+                                     "ComSpec", "PATHEXT", "TEMP", "TMP" };
+#else
+const char* const hermeticVars[] = { "HOME", "USER", "TMPDIR", "WINEPREFIX" };
+#endif
+
+// --prewarm: the learned headers read ahead / kept in the list
+const size_t maxPrewarmHeaders = 256;
+const size_t maxLearnedHeaders = 1024;
+
+/**
+ * --prewarm: the program database binaries of a version. Visual C++ 2008
+ * still uses the ones of 8.0, mspdbsrv.exe came with 8.0.
+ */
+struct PdbFiles {
+    const char* version;
+    const char* dll;
+    const char* server;     // 0 if there is none
+};
+
+const PdbFiles pdbFiles[] = {
+    { "6",   "mspdb60.dll",  0 },
+    { "60",  "mspdb60.dll",  0 },
+    { "71",  "mspdb71.dll",  0 },
+    { "80",  "mspdb80.dll",  "mspdbsrv.exe" },
+    { "90",  "mspdb80.dll",  "mspdbsrv.exe" },
+    { "100", "mspdb100.dll", "mspdbsrv.exe" },
+};
+
+// the syntax of the commands printed by 'envvc diff'
+enum ShellSyntax { shellCmd, shellSh, shellPowerShell };
+
+/**
+ * The translation units 'envvc bench' compiles. They only use what all
+ * versions since Visual C++ 6.0 understand (no partial specialization,
+ * no explicit template arguments for function templates), and headers of
+ * the C runtime and the standard library only, as the INCLUDE of older
+ * toolchains has no Platform SDK.
+ */
+struct BenchCase {
+    const char* name;
+    const char* source;
+};
+
+const BenchCase benchCases[] = {
+    { "templates",
+      "#include <algorithm>\n"
+      "#include <map>\n"
+      "#include <string>\n"
+      "#include <vector>\n"
+      "\n"
+      "template<int N> struct Fib { enum { value = Fib<N - 1>::value + Fib<N - 2>::value }; };\n"
+      "template<> struct Fib<1> { enum { value = 1 }; };\n"
+      "template<> struct Fib<0> { enum { value = 0 }; };\n"
+      "\n"
+      "template<int N> struct Tag {\n"
+      "    int data[N % 7 + 1];\n"
+      "    bool operator<(const Tag& other) const { return data[0] < other.data[0]; }\n"
+      "};\n"
+      "\n"
+      "template<class T> struct Holder {\n"
+      "    std::vector<T> items;\n"
+      "    std::map<std::string, T> named;\n"
+      "    void add(const std::string& name, const T& item)\n"
+      "    {\n"
+      "        items.push_back(item);\n"
+      "        named.insert(std::make_pair(name, item));\n"
+      "    }\n"
+      "    void sortAll() { std::sort(items.begin(), items.end()); }\n"
+      "};\n"
+      "\n"
+      "template<int N> struct Use {\n"
+      "    static int run()\n"
+      "    {\n"
+      "        Holder<Tag<N> > holder;\n"
+      "        holder.add(\"x\", Tag<N>());\n"
+      "        holder.sortAll();\n"
+      "        return Fib<N % 20 + 1>::value + Use<N - 1>::run();\n"
+      "    }\n"
+      "};\n"
+      "template<> struct Use<0> { static int run() { return 0; } };\n"
+      "\n"
+      "int main() { return Use<100>::run() > 0 ? 0 : 1; }\n" },
+    { "headers",
+      "#include <stdio.h>\n"
+      "#include <stdlib.h>\n"
+      "#include <string.h>\n"
+      "#include <time.h>\n"
+      "#include <algorithm>\n"
+      "#include <deque>\n"
+      "#include <fstream>\n"
+      "#include <functional>\n"
+      "#include <iomanip>\n"
+      "#include <iostream>\n"
+      "#include <list>\n"
+      "#include <map>\n"
+      "#include <set>\n"
+      "#include <sstream>\n"
+      "#include <string>\n"
+      "#include <vector>\n"
+      "\n"
+      "int main()\n"
+      "{\n"
+      "    std::ostringstream out;\n"
+      "    out << static_cast<long>(time(0));\n"
+      "    std::cout << out.str() << std::endl;\n"
+      "    return 0;\n"
+      "}\n" },
+    { "function",
+      "#define STEP(i) x = x * 31 + (i); if (x & 1) y ^= x >> 3; else y += x << 2;\n"
+      "#define STEP10(i) STEP(i) STEP(i + 1) STEP(i + 2) STEP(i + 3) STEP(i + 4) \\\n"
+      "    STEP(i + 5) STEP(i + 6) STEP(i + 7) STEP(i + 8) STEP(i + 9)\n"
+      "#define STEP100(i) STEP10(i) STEP10(i + 10) STEP10(i + 20) STEP10(i + 30) \\\n"
+      "    STEP10(i + 40) STEP10(i + 50) STEP10(i + 60) STEP10(i + 70) STEP10(i + 80) \\\n"
+      "    STEP10(i + 90)\n"
+      "\n"
+      "unsigned long compute(unsigned long x, unsigned long y)\n"
+      "{\n"
+      "    STEP100(0) STEP100(100) STEP100(200) STEP100(300) STEP100(400)\n"
+      "    STEP100(500) STEP100(600) STEP100(700) STEP100(800) STEP100(900)\n"
+      "    STEP100(1000) STEP100(1100) STEP100(1200) STEP100(1300) STEP100(1400)\n"
+      "    STEP100(1500) STEP100(1600) STEP100(1700) STEP100(1800) STEP100(1900)\n"
+      "    return x ^ y;\n"
+      "}\n"
+      "\n"
+      "int main() { return static_cast<int>(compute(1, 2) & 1); }\n" },
+};
+
+/**
+ * The code of the launchers 'envvc bake' writes, after the generated data
+ * (tool, wine, rebake, isComplete, vars, stampFiles, stamp). It is plain C
+ * that Visual C++ 6.0 compiles as well, and it needs the C runtime headers
+ * only: the INCLUDE of older toolchains has no Platform SDK. The stamp is an
+ * FNV-1a hash of the variables and of the size and modification time of the
+ * stamp files, the same as stampHash() computes.
+ */
+const char launcherSource[] =
+    "\n"
+    "static unsigned long hashWord(unsigned long hash, unsigned long word)\n"
+    "{\n"
+    "    int i;\n"
+    "    for (i = 0; i < 4; ++i)\n"
+    "        hash = ((hash ^ ((word >> (8 * i)) & 0xFF)) * 16777619ul) & 0xFFFFFFFFul;\n"
+    "    return hash;\n"
+    "}\n"
+    "\n"
+    "static void checkStamp(void)\n"
+    "{\n"
+    "    unsigned long hash = 2166136261ul;\n"
+    "    const char* p;\n"
+    "    int i;\n"
+    "    int k;\n"
+    "    for (i = 0; vars[i].entry != 0; ++i) {\n"
+    "        for (p = vars[i].entry; ; ++p) {\n"
+    "            hash = ((hash ^ (unsigned char)*p) * 16777619ul) & 0xFFFFFFFFul;\n"
+    "            if (*p == '\\0')\n"
+    "                break;\n"
+    "        }\n"
+    "    }\n"
+    "    for (i = 0; stampFiles[i] != 0; ++i) {\n"
+    "        /* size and time, all bits set if it is missing */\n"
+    "        unsigned long words[4];\n"
+    "        struct stat info;\n"
+    "        if (stat(stampFiles[i], &info) == 0) {\n"
+    "            words[0] = (unsigned long)info.st_size & 0xFFFFFFFFul;\n"
+    "            words[1] = (unsigned long)(info.st_size >> 16 >> 16) & 0xFFFFFFFFul;\n"
+    "            words[2] = (unsigned long)info.st_mtime & 0xFFFFFFFFul;\n"
+    "            words[3] = (unsigned long)(info.st_mtime >> 16 >> 16) & 0xFFFFFFFFul;\n"
+    "        }\n"
+    "        else\n"
+    "            words[0] = words[1] = words[2] = words[3] = 0xFFFFFFFFul;\n"
+    "        for (k = 0; k < 4; ++k)\n"
+    "            hash = hashWord(hash, words[k]);\n"
+    "    }\n"
+    "    if (hash != stamp)\n"
+    "        fprintf(stderr, \"warning: the toolchain of %s changed since this launcher \"\n"
+    "                \"was baked, bake it again with\\n    %s\\n\", tool, rebake);\n"
+    "}\n"
+    "\n"
+    "/* sets a variable, search lists in front of the current value */\n"
+    "static void setVar(const char* entry, char separator)\n"
+    "{\n"
+    "    const char* value = strchr(entry, '=') + 1;\n"
+    "    size_t nameLen = value - entry - 1;\n"
+    "    char* name = (char*)malloc(nameLen + 1);\n"
+    "    const char* current;\n"
+    "    char* list = 0;\n"
+    "    memcpy(name, entry, nameLen);\n"
+    "    name[nameLen] = '\\0';\n"
+    "    if (separator != '\\0') {\n"
+    "        current = getenv(name);\n"
+    "        if (current != 0 && *current != '\\0') {\n"
+    "            list = (char*)malloc(strlen(value) + strlen(current) + 2);\n"
+    "            sprintf(list, \"%s%c%s\", value, separator, current);\n"
+    "            value = list;\n"
+    "        }\n"
+    "    }\n"
+    "#ifdef _WIN32\n"
+    "    list = (char*)malloc(nameLen + strlen(value) + 2);\n"
+    "    sprintf(list, \"%s=%s\", name, value);\n"
+    "    _putenv(list);\n"
+    "#else\n"
+    "    setenv(name, value, 1);\n"
+    "#endif\n"
+    "}\n"
+    "\n"
+    "#ifdef _WIN32\n"
+    "/* the C runtime joins the arguments with spaces, without quoting them */\n"
+    "static char* quoteArg(const char* arg)\n"
+    "{\n"
+    "    size_t size = 3;\n"
+    "    const char* p;\n"
+    "    char* quoted;\n"
+    "    char* out;\n"
+    "    if (*arg != '\\0' && strpbrk(arg, \" \\t\\\"\") == 0)\n"
+    "        return (char*)arg;\n"
+    "    for (p = arg; *p != '\\0'; ++p)\n"
+    "        size += *p == '\"' || *p == '\\\\' ? 2 : 1;\n"
+    "    quoted = out = (char*)malloc(size);\n"
+    "    *out++ = '\"';\n"
+    "    for (p = arg; ; ++p) {\n"
+    "        size_t slashes = 0;\n"
+    "        while (*p == '\\\\') {\n"
+    "            ++slashes;\n"
+    "            ++p;\n"
+    "        }\n"
+    "        /* backslashes are doubled in front of a quote */\n"
+    "        if (*p == '\\0' || *p == '\"')\n"
+    "            slashes = slashes * 2 + (*p == '\"');\n"
+    "        for (; slashes > 0; --slashes)\n"
+    "            *out++ = '\\\\';\n"
+    "        if (*p == '\\0')\n"
+    "            break;\n"
+    "        *out++ = *p;\n"
+    "    }\n"
+    "    *out++ = '\"';\n"
+    "    *out = '\\0';\n"
+    "    return quoted;\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "int main(int argc, char* argv[])\n"
+    "{\n"
+    "    char** args = (char**)malloc((argc + 2) * sizeof(char*));\n"
+    "    char** environment = 0;\n"
+    "    int count = 0;\n"
+    "    int i;\n"
+    "\n"
+    "    checkStamp();\n"
+    "\n"
+    "    /* our own name is replaced by the tool */\n"
+    "#ifdef _WIN32\n"
+    "    args[count++] = quoteArg(tool);\n"
+    "    for (i = 1; i < argc; ++i)\n"
+    "        args[count++] = quoteArg(argv[i]);\n"
+    "#else\n"
+    "    args[count++] = (char*)wine;\n"
+    "    args[count++] = (char*)tool;\n"
+    "    for (i = 1; i < argc; ++i)\n"
+    "        args[count++] = argv[i];\n"
+    "#endif\n"
+    "    args[count] = 0;\n"
+    "\n"
+    "    if (isComplete) {\n"
+    "        for (i = 0; vars[i].entry != 0; ++i)\n"
+    "            ;\n"
+    "        environment = (char**)malloc((i + 1) * sizeof(char*));\n"
+    "        for (i = 0; vars[i].entry != 0; ++i)\n"
+    "            environment[i] = (char*)vars[i].entry;\n"
+    "        environment[i] = 0;\n"
+    "    }\n"
+    "    else {\n"
+    "        for (i = 0; vars[i].entry != 0; ++i)\n"
+    "            setVar(vars[i].entry, vars[i].separator);\n"
+    "    }\n"
+    "\n"
+    "#ifdef _WIN32\n"
+    "    {\n"
+    "        int exitCode;\n"
+    "        /* Ctrl+C goes to the tool as well, it decides when to stop */\n"
+    "        signal(SIGINT, SIG_IGN);\n"
+    "        errno = 0;\n"
+    "        exitCode = environment != 0\n"
+    "            ? (int)_spawnve(_P_WAIT, tool, (const char* const*)args,\n"
+    "                            (const char* const*)environment)\n"
+    "            : (int)_spawnv(_P_WAIT, tool, (const char* const*)args);\n"
+    "        if (exitCode != -1 || errno == 0)\n"
+    "            return exitCode;\n"
+    "        fprintf(stderr, \"failed to execute %s: %s\\n\", tool, strerror(errno));\n"
+    "        return 1;\n"
+    "    }\n"
+    "#else\n"
+    "    if (environment != 0)\n"
+    "        execve(wine, args, environment);\n"
+    "    else\n"
+    "        execv(wine, args);\n"
+    "    fprintf(stderr, \"failed to execute %s: %s\\n\", wine, strerror(errno));\n"
+    "    return 127;\n"
+    "#endif\n"
+    "}\n";
+
 const string msDir("HKLM\\SOFTWARE\\Microsoft\\");
 const string devDiv("HKLM\\SOFTWARE\\Microsoft\\DevDiv\\");
 const string studioDir("HKLM\\SOFTWARE\\Microsoft\\VisualStudio\\");
 const string expressDir("HKLM\\SOFTWARE\\Microsoft\\VCExpress\\");
 
+/**
+ * Target architectures as named by vcvarsall.bat, with the directory
+ * suffixes that differ between them.
+ */
+struct TargetArch {
+    const char* name;
+    const char* vcBin;          // below VCINSTALLDIR
+    const char* vcLib;          // below VCINSTALLDIR and the .NET SDK
+    const char* atlmfcLib;      // below VCINSTALLDIR
+    const char* platformSdkLib; // below VCINSTALLDIR (8.0 only)
+    const char* sdkLib;         // below the Windows SDK
+    bool isCross;               // x86 hosted tools for another target
+    bool isNative64;            // 64 bit hosted tools (Framework64)
+};
+
+const TargetArch targetArchs[] = {
+    { "x86", "\\bin", "\\lib", "\\atlmfc\\lib",
+      "\\platformSDK\\lib", "\\lib", false, false },
+    { "amd64", "\\bin\\amd64", "\\lib\\amd64", "\\atlmfc\\lib\\amd64",
+      "\\platformSDK\\lib\\amd64", "\\lib\\x64", false, true },
+    { "x86_amd64", "\\bin\\x86_amd64", "\\lib\\amd64", "\\atlmfc\\lib\\amd64",
+      "\\platformSDK\\lib\\amd64", "\\lib\\x64", true, false },
+};
+
+// the toolchains envvc knows, oldest first
+const char* const toolchainVersions[] = { "60", "71", "80", "90", "100" };
+
+// start value and multiplier of the FNV-1a hash
+const unsigned fnvBasis = 2166136261u;
+const unsigned fnvPrime = 16777619u;
+
 const string banner("envvc - environment tool for Visual C++ X.Y\n"
                     "    (c) 2005-2010 Peter Steiner\n"
                     "    (c) 2005-2007 Hug-Witschi AG\n");
@@ -61,6 +435,7 @@ const string banner("envvc - environment tool for Visual C++ X.Y\n"
 +-----------------------------------------------------------------------------*/
 
 
+#ifdef _WIN32
 class RegistryKey {
 public:
     explicit RegistryKey(const std::string& key);
@@ -76,6 +451,326 @@ public:
 private:
     HKEY keyHandle_;
 };
+#endif
+
+
+/**
+ * Source of the registry values the toolchains are resolved from. Missing
+ * keys and values throw std::runtime_error.
+ */
+class RegistryBackend {
+public:
+    virtual ~RegistryBackend() {}
+
+    virtual std::string getString(const std::string& key,
+                                  const std::string& valueName) const = 0;
+    virtual DWORD getDword(const std::string& key,
+                           const std::string& valueName) const = 0;
+};
+
+
+#ifdef _WIN32
+/**
+ * The registry of the running system.
+ */
+class LiveRegistry : public RegistryBackend {
+public:
+    std::string getString(const std::string& key,
+                          const std::string& valueName) const
+    {
+        return RegistryKey::getString(key, valueName);
+    }
+    DWORD getDword(const std::string& key,
+                   const std::string& valueName) const
+    {
+        return RegistryKey::getDword(key, valueName);
+    }
+};
+#endif
+
+
+/**
+ * A whole file mapped read-only into memory.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& fileName);
+    ~MappedFile();
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    void close();
+
+    const char* data_;
+    size_t size_;
+#ifdef _WIN32
+    HANDLE file_;
+    HANDLE mapping_;
+#else
+    int fd_;
+#endif
+};
+
+
+/**
+ * A registry snapshot read from files exported with regedit ("REGEDIT4"
+ * ANSI or "Windows Registry Editor Version 5.00" UTF-16) or from the
+ * registry files of a Wine prefix ("WINE REGISTRY Version 2").
+ *
+ * Loading maps the files and only indexes the key lines; the values are
+ * parsed when they are looked up, which happens a few dozen times per run.
+ */
+class RegFileRegistry : public RegistryBackend {
+public:
+    RegFileRegistry() {}
+    ~RegFileRegistry();
+
+    void load(const std::string& fileName, const char* root = "");
+    bool empty() const { return files_.empty(); }
+
+    std::string getString(const std::string& key,
+                          const std::string& valueName) const;
+    DWORD getDword(const std::string& key,
+                   const std::string& valueName) const;
+
+private:
+    RegFileRegistry(const RegFileRegistry&);
+    RegFileRegistry& operator=(const RegFileRegistry&);
+
+    struct KeyEntry {
+        unsigned hash;
+        const char* root;       // for key names relative to a root key
+        const char* name;       // without the brackets
+        size_t nameLen;
+        bool isEscaped;         // Wine doubles the backslashes
+        const char* body;       // the line after the key
+        const char* end;        // end of the file text
+    };
+
+    std::string findValue(const std::string& key,
+                          const std::string& valueName) const;
+    static bool findInKey(const KeyEntry& entry, const std::string& valueName,
+                          std::string& data);
+    static bool isSameKey(const KeyEntry& entry, const std::string& key);
+    static unsigned hashKey(unsigned hash, const char* name, size_t size,
+                            bool isEscaped);
+    static std::string unquote(const std::string& data);
+    static void appendNarrow(const char* utf16, size_t units,
+                             std::vector<char>& out);
+
+    std::vector<MappedFile*> files_;
+    std::list<std::vector<char> > decoded_;     // text of the UTF-16 files
+    std::vector<KeyEntry> keys_;                // in load order
+    std::vector<unsigned> buckets_;             // open addressing into keys_
+};
+
+
+/**
+ * A ';' separated search list (PATH, INCLUDE, LIB...) that is assembled
+ * from views of the directory strings instead of copies. Its entries take
+ * one allocation for the toolchain directories and at most one more for an
+ * inherited list; Environment::set() renders it with a single allocation.
+ *
+ * The segments only reference the strings passed in, so these must outlive
+ * the PathList. They are taken by non-const reference so that temporaries
+ * don't compile.
+ */
+class PathList {
+public:
+    PathList();
+
+    PathList& add(std::string& dir, const char* suffix = "");
+    PathList& addList(std::string& list);
+
+    bool empty() const { return segments_.empty(); }
+    std::string::size_type length() const;
+    void appendTo(std::string& out) const;
+
+private:
+    struct Segment {
+        const char* head;
+        std::string::size_type headLen;
+        const char* tail;
+        std::string::size_type tailLen;
+
+        std::string::size_type size() const { return headLen + tailLen; }
+    };
+
+    std::vector<Segment> segments_;
+};
+
+
+/**
+ * The variables resolved for one toolchain and target architecture.
+ */
+class Environment {
+public:
+    explicit Environment(const std::string& arch);
+
+    void set(const std::string& var, const std::string& value);
+    void set(const std::string& var, const PathList& value);
+    void setComplete() { isComplete_ = true; }
+
+    const std::string& arch() const { return arch_; }
+    const std::vector<std::string>& entries() const { return entries_; }
+    bool isComplete() const { return isComplete_; }
+    std::string get(const std::string& var) const;
+    void apply() const;
+    std::string str() const;
+
+private:
+    std::string& entry(const std::string& var);
+
+    std::string arch_;
+    std::vector<std::string> entries_;  // "VAR=value"
+    bool isComplete_;                   // nothing else is inherited
+};
+
+
+#ifndef _WIN32
+/**
+ * Directory listings for finding the case of paths on case-sensitive file
+ * systems. The listings are shared by all paths resolved in a run and kept
+ * in a file between runs; a listing is read again when the modification
+ * time of its directory changed.
+ */
+class DirectoryCache {
+public:
+    explicit DirectoryCache(const std::string& fileName);
+
+    bool canonical(std::string& path, std::string::size_type begin);
+    void save() const;
+
+private:
+    struct Listing {
+        time_t mtime;
+        bool isChecked;     // the modification time was compared in this run
+        bool isStable;      // not changed in the second it was read
+        std::map<std::string, std::string> names;   // by case-folded name
+    };
+
+    const Listing* listing(const std::string& dir);
+    static std::string folded(const std::string& name);
+
+    std::string fileName_;
+    std::map<std::string, Listing> dirs_;
+    bool isChanged_;
+};
+#endif
+
+
+/**
+ * Durations of one command run, in seconds, for the latency statistics.
+ */
+struct RunTimes {
+    double resolve;     // from the start of envvc until the command is started
+    double spawn;       // until the command runs
+    double child;       // until the command exited
+};
+
+
+/**
+ * A histogram of durations in microseconds with logarithmic buckets of 64
+ * linear sub-buckets each (as in HdrHistogram), i.e. with a relative error
+ * below 2% at any magnitude.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void add(double micros);
+    unsigned long count() const { return total_; }
+    double percentile(double percent) const;
+
+private:
+    static size_t bucket(unsigned long value);
+    static unsigned long highestValue(size_t bucket);
+
+    std::vector<unsigned long> counts_;
+    unsigned long total_;
+    double max_;
+};
+
+
+/**
+ * The times of one benchmark case under one toolchain.
+ */
+struct BenchResult {
+    std::string version;
+    std::string compiler;
+    std::string caseName;
+    std::string status;         // "ok", "failed", "not found"...
+    double median;              // seconds
+    double minimum;
+};
+
+
+#ifdef _WIN32
+// PrefetchVirtualMemory (Windows 8) is not in the SDK of Visual C++ 2010
+struct PrefetchRange {
+    void* address;
+    SIZE_T size;
+};
+typedef BOOL (WINAPI *PrefetchVirtualMemoryFunc)(HANDLE, ULONG_PTR, PrefetchRange*, ULONG);
+#endif
+
+
+#ifdef _WIN32
+/**
+ * State of one toolchain in the matrix mode.
+ */
+struct MatrixRun {
+    std::string version;
+    std::string compiler;
+    std::string status;     // empty until finished or skipped
+    DWORD exitCode;
+    DWORD ticks;            // start time, then duration
+    HANDLE process;
+    HANDLE log;
+};
+#endif
+
+
+/**
+ * Client side of the GNU make jobserver announced with --jobserver-auth in
+ * MAKEFLAGS: a named semaphore on Windows, a fifo ("fifo:PATH") or the
+ * inherited ends of a pipe ("R,W") on POSIX.
+ *
+ * envvc itself runs on the implicit token of its make job; additional
+ * tokens are only taken for children that run parallel jobs themselves.
+ */
+class JobServer {
+public:
+    JobServer();
+    ~JobServer();
+
+#ifdef _WIN32
+    bool isActive() const { return semaphore_ != 0; }
+#else
+    bool isActive() const { return readFd_ != -1; }
+#endif
+    unsigned acquire(unsigned wanted);
+    void release();
+
+private:
+    JobServer(const JobServer&);
+    JobServer& operator=(const JobServer&);
+
+#ifdef _WIN32
+    HANDLE semaphore_;
+    LONG tokens_;
+#else
+    int readFd_;                // our own, non-blocking
+    int writeFd_;               // readFd_ for a fifo, else make's
+    char tokens_[256];          // the bytes read, make wants them back
+    volatile sig_atomic_t count_;
+#endif
+};
 
 
 /*-----------------------------------------------------------------------------+
@@ -83,24 +778,164 @@ private:
 +-----------------------------------------------------------------------------*/
 
 static void printUsage();
-static bool doVC6();
-static bool doVC71();
-static bool doVC80(bool useFX);
-static bool doVC90();
-static bool doVC100();
+static bool resolveToolchain(const std::string& version, bool useFX,
+                             const std::vector<const TargetArch*>& archs,
+                             std::vector<Environment>& envs);
+static bool isKnownVersion(const std::string& version);
+static const TargetArch* findArch(const std::string& name);
+static bool doVC6(Environment& env);
+static bool doVC71(Environment& env);
+static bool doVC80(bool useFX,
+                   const std::vector<const TargetArch*>& archs,
+                   std::vector<Environment>& envs);
+static bool doVC90(const std::vector<const TargetArch*>& archs,
+                   std::vector<Environment>& envs);
+static bool doVC100(const std::vector<const TargetArch*>& archs,
+                    std::vector<Environment>& envs);
+
+static std::string programName(char* const* args);
+static std::string jobServerName();
+static void limitParallelism(JobServer& jobServer,
+                             std::vector<char*>& args,
+                             std::string& storage);
+#ifdef _WIN32
+static BOOL WINAPI onConsoleCtrl(DWORD ctrlType);
+#else
+static void onSignal(int signal);
+#endif
 
 static std::string trimmedString(const std::string& key,
                                  const std::string& valueName);
 
 static std::string getEnv(const std::string& var);
-static void putEnv(const std::string& var, const std::string& value);
+static std::string inheritedList(const std::string& var);
+static std::vector<std::string> splitList(const std::string& list, char separator);
+
+static char listSeparator(const std::string& var);
+static unsigned fnvHash(unsigned hash, const void* data, size_t size);
+static bool isPrefixDependent(const std::string& entry);
+static void makeHermetic(Environment& env);
+static void clearEnvironment();
+
+static void loadWinePrefix(RegFileRegistry& regFiles, const std::string& prefix);
+static std::string unixPath(const std::string& prefix,
+                            const std::string& windowsPath);
+static void canonicalCase(std::string& windowsPath, std::string& path);
+static void translateForWine(Environment& env, const std::string& prefix);
+#ifndef _WIN32
+static std::string findWine();
+#endif
+static std::string cacheFile(const std::string& name);
+
+static bool isSearchList(const std::string& var);
+static std::string shellLiteral(const std::string& text, ShellSyntax shell,
+                                bool inDoubleQuotes = false);
+static void printSet(const std::string& var, const std::string& value,
+                     ShellSyntax shell);
+static void printUnset(const std::string& var, ShellSyntax shell);
+static void printListEdit(const std::string& var, const std::string& from,
+                          const std::string& to, ShellSyntax shell);
+static void printDiff(const Environment& from, const Environment& to,
+                      ShellSyntax shell);
+static std::string listEntryKey(const std::string& dir);
+static Environment currentToolchain(bool useFX,
+                                    const std::vector<const TargetArch*>& archs);
+
+static double now();
+static void annotateLines(const char* data, size_t size,
+                          const std::string& prefix, bool withTime,
+                          bool& atLineStart, std::string& out);
+static void recordTimes(const std::string& version, char* const* args);
+static int printStats(const std::string& fileName);
+#ifndef _WIN32
+static void writeAll(int fd, const char* data, size_t size);
+static int runTimed(char* const* args, const std::string& logName,
+                    const std::string& prefix, bool withTime,
+                    std::vector<std::string>* includes);
+#endif
+
+static std::string prewarmListFile(const std::string& version,
+                                   const Environment& env);
+static bool fileExists(const std::string& fileName);
+static std::vector<std::string> prewarmList(const Environment& env,
+                                            const std::string& version,
+                                            const std::string& listFile);
+#ifdef _WIN32
+static unsigned __stdcall prewarmThread(void* fileList);
+#endif
+static void prewarm(const std::vector<std::string>& files);
+static void findIncludes(const char* data, size_t size, std::string& pending,
+                         std::vector<std::string>& includes);
+static void learnIncludes(const std::string& listFile,
+                          const std::vector<std::string>& includes);
+
+#ifdef _WIN32
+static std::string commandLine(char* const* args);
+static std::vector<char> environmentBlock(const Environment& env,
+                                          const std::vector<std::string>& extra);
+static std::string findProgram(const std::string& program,
+                               const Environment& env);
+static PROCESS_INFORMATION startProcess(char* const* args,
+                                        const Environment& env,
+                                        std::vector<char>& envBlock,
+                                        HANDLE output);
+static void writeAll(HANDLE handle, const char* data, DWORD size);
+static int runLogged(char* const* args, const Environment& env,
+                     const std::string& logName,
+                     const std::string& prefix, bool withTime,
+                     std::vector<std::string>* includes);
+static int runMatrix(const std::vector<std::string>& versions,
+                     bool useFX, bool isForced,
+                     const std::vector<const TargetArch*>& archs,
+                     unsigned maxJobs, const std::string& outDir,
+                     char* const* args);
+#endif
+
+static void makeDirectory(const std::string& dir);
+static double compileOnce(const Environment& env,
+                          const std::vector<std::string>& command,
+                          const std::string& logName);
+static std::string jsonString(const std::string& text);
+static int runBench(const std::vector<std::string>& versions,
+                    bool useFX, bool isForced,
+                    const std::vector<const TargetArch*>& archs,
+                    unsigned runs, bool asJson);
+
+static std::string cLiteral(const std::string& text);
+static std::string findTool(const std::string& program, const Environment& env);
+static std::vector<std::string> listBinaries(const std::string& dir);
+static std::vector<std::string> stampFiles(const Environment& env,
+                                           const std::string& version,
+                                           const std::string& tool);
+static unsigned stampWord(unsigned hash, unsigned long word);
+static unsigned stampHash(const std::vector<std::string>& entries,
+                          const std::vector<std::string>& files);
+static std::string rebakeCommand(char* const* args);
+static void writeLauncher(std::ostream& out, const Environment& env,
+                          const std::string& tool,
+                          const std::vector<std::string>& files,
+                          const std::string& command);
+static int bake(const Environment& env, const std::string& version,
+                const std::string& tool, const std::string& outName,
+                const std::string& command);
 
 /*-----------------------------------------------------------------------------+
 |   module global variables                                                    |
 +-----------------------------------------------------------------------------*/
 
-string envCollection;
 string compiler;
+const RegistryBackend* registry = 0;
+string winePrefix;
+bool isInheriting = true;   // put the toolchain entries in front of our lists
+bool isHermetic = false;
+vector<string> keptVars;    // --hermetic: the inherited variables
+vector<string> extraDirs;   // --hermetic: appended to PATH
+string statsFile;           // ENVVC_STATS
+RunTimes runTimes = { 0, 0, 0 };
+JobServer* activeJobServer = 0;
+#ifndef _WIN32
+DirectoryCache* directoryCache = 0;
+#endif
 
 /*-----------------------------------------------------------------------------+
 |   functions                                                                  |
@@ -111,11 +946,32 @@ string compiler;
 /*----------------------------------------------------------------------------*/
 int main (int argc, char* argv[])
 {
+    double started = now();
+    char* const* const allArgs = argv;
+    statsFile = getEnv("ENVVC_STATS");
     int retval = 1;
     try {
         bool isVerbose = false;
         bool isForced = false;
         bool useFX = false;
+        vector<const TargetArch*> archs;
+        vector<string> matrix;
+        string matrixDir("envvc-matrix");
+        string logName;
+        string logPrefix;
+        bool logTime = false;
+#ifdef _WIN32
+        unsigned maxJobs = 0;
+#endif
+        bool isPrewarming = false;
+        unsigned benchRuns = 5;
+        bool isJson = false;
+        RegFileRegistry regFiles;
+#ifdef _WIN32
+        ShellSyntax shell = shellCmd;
+#else
+        ShellSyntax shell = shellSh;
+#endif
         bool foundValidOption = true;
         while (argc > 1 && foundValidOption)
         {
@@ -138,6 +994,126 @@ int main (int argc, char* argv[])
                 --argc;
                 ++argv;
             }
+            else if (arg1 == "--arch" && argc > 2)
+            {
+                vector<string> names = splitList(argv[2], ',');
+                for (vector<string>::const_iterator it = names.begin(); it != names.end(); ++it)
+                    archs.push_back(findArch(*it));
+                argc -= 2;
+                argv += 2;
+            }
+            else if (arg1 == "--matrix" && argc > 2)
+            {
+                matrix = splitList(argv[2], ',');
+                argc -= 2;
+                argv += 2;
+            }
+            else if (arg1 == "--matrix-dir" && argc > 2)
+            {
+                matrixDir = argv[2];
+                argc -= 2;
+                argv += 2;
+            }
+            else if (arg1 == "--reg" && argc > 2)
+            {
+                regFiles.load(argv[2]);
+                argc -= 2;
+                argv += 2;
+            }
+            else if (arg1 == "--wine" && argc > 2)
+            {
+                winePrefix = argv[2];
+                loadWinePrefix(regFiles, winePrefix);
+                argc -= 2;
+                argv += 2;
+            }
+            else if (arg1 == "--log" && argc > 2)
+            {
+                logName = argv[2];
+                argc -= 2;
+                argv += 2;
+            }
+            else if (arg1 == "--log-prefix" && argc > 2)
+            {
+                logPrefix = argv[2];
+                argc -= 2;
+                argv += 2;
+            }
+            else if (arg1 == "--log-time")
+            {
+                logTime = true;
+                --argc;
+                ++argv;
+            }
+#ifdef _WIN32
+            else if (arg1 == "-j" && argc > 2)
+            {
+                maxJobs = static_cast<unsigned>(atoi(argv[2]));
+                argc -= 2;
+                argv += 2;
+            }
+#else
+            else if (arg1 == "-j")
+                throw runtime_error(arg1 + " is only supported on Windows");
+#endif
+            else if (arg1 == "--hermetic")
+            {
+                isHermetic = true;
+                isInheriting = false;
+                keptVars.insert(keptVars.begin(), hermeticVars,
+                                hermeticVars + sizeof(hermeticVars) / sizeof(hermeticVars[0]));
+                --argc;
+                ++argv;
+            }
+            else if (arg1 == "--keep" && argc > 2)
+            {
+                vector<string> names = splitList(argv[2], ',');
+                keptVars.insert(keptVars.end(), names.begin(), names.end());
+                argc -= 2;
+                argv += 2;
+            }
+            else if (arg1 == "--extra-path" && argc > 2)
+            {
+                extraDirs.push_back(argv[2]);
+                argc -= 2;
+                argv += 2;
+            }
+            else if (arg1 == "--runs" && argc > 2)
+            {
+                char* end = 0;
+                long runs = strtol(argv[2], &end, 10);
+                if (*end != '\0' || runs < 1 || runs > 1000)
+                    throw runtime_error("--runs needs a number from 1 to 1000");
+                benchRuns = static_cast<unsigned>(runs);
+                argc -= 2;
+                argv += 2;
+            }
+            else if (arg1 == "--json")
+            {
+                isJson = true;
+                --argc;
+                ++argv;
+            }
+            else if (arg1 == "--prewarm")
+            {
+                isPrewarming = true;
+                --argc;
+                ++argv;
+            }
+            else if (arg1 == "--shell" && argc > 2)
+            {
+                string name(argv[2]);
+                if (name == "cmd")
+                    shell = shellCmd;
+                else if (name == "sh")
+                    shell = shellSh;
+                else if (name == "powershell" || name == "ps")
+                    shell = shellPowerShell;
+                else
+                    throw runtime_error("unknown shell " + name);
+                argc -= 2;
+                argv += 2;
+            }
             else
                 foundValidOption = false;
         }
@@ -148,24 +1124,207 @@ int main (int argc, char* argv[])
             exit(1);
         }
 
+        if (!isHermetic && (!keptVars.empty() || !extraDirs.empty()))
+            throw runtime_error("--keep and --extra-path need --hermetic");
+
+        if (string(argv[1]) == "stats")
+            return printStats(argc > 2 ? string(argv[2]) : statsFile);
+
+        if (archs.empty())
+            archs.push_back(findArch("x86"));
+
+#ifdef _WIN32
+        LiveRegistry liveRegistry;
+        registry = regFiles.empty()
+            ? static_cast<const RegistryBackend*>(&liveRegistry)
+            : &regFiles;
+#else
+        if (regFiles.empty())
+            throw runtime_error("there is no registry on this system, use --reg");
+        registry = &regFiles;
+
+        if (!matrix.empty())
+            throw runtime_error("--matrix is only supported on Windows");
+
+        // without Wine PATH only has the Windows form of the directories
+        if (winePrefix.empty() && argc > 2 && isKnownVersion(argv[1]))
+            throw runtime_error("commands can only be run with --wine on this system");
+#endif
+
+#ifdef _WIN32
+        if (!matrix.empty())
+        {
+            if (maxJobs == 0)
+            {
+                SYSTEM_INFO info;
+                GetSystemInfo(&info);
+                maxJobs = info.dwNumberOfProcessors;
+            }
+            // WaitForMultipleObjects can't wait for more
+            maxJobs = std::min<unsigned>(maxJobs, MAXIMUM_WAIT_OBJECTS);
+            return runMatrix(matrix, useFX, isForced, archs, maxJobs,
+                             matrixDir, argv+1);
+        }
+#endif
+
+        if (string(argv[1]) == "bench")
+        {
+            // all of them before the first compile
+            vector<string> versions;
+            for (int i = 2; i < argc; ++i)
+            {
+                if (argv[i][0] == '-')
+                    throw runtime_error(string("options go before 'bench': ") + argv[i]);
+                vector<string> names = splitList(argv[i], ',');
+                for (vector<string>::const_iterator it = names.begin(); it != names.end(); ++it)
+                {
+                    if (!isKnownVersion(*it))
+                        throw runtime_error("unknown version " + *it);
+                }
+                versions.insert(versions.end(), names.begin(), names.end());
+            }
+            return runBench(versions, useFX, isForced, archs, benchRuns, isJson);
+        }
+
+        if (string(argv[1]) == "bake")
+        {
+            string version;
+            string tool("cl");
+            string outName;
+            int positional = 0;
+            for (int i = 2; i < argc; ++i)
+            {
+                string arg(argv[i]);
+                if (arg == "--out" && i + 1 < argc)
+                    outName = argv[++i];
+                else if (positional++ == 0)
+                    version = arg;
+                else if (positional == 2)
+                    tool = arg;
+                else
+                    version.clear();
+            }
+            if (!isKnownVersion(version) || outName.empty())
+            {
+                printUsage();
+                exit(1);
+            }
+            if (archs.size() > 1)
+                throw runtime_error("bake needs a single architecture");
+#ifndef _WIN32
+            if (winePrefix.empty())
+                throw runtime_error("bake needs Windows or --wine");
+#endif
+
+            // the launcher puts the toolchain lists in front of the lists
+            // it finds when it runs
+            isInheriting = false;
+            vector<Environment> envs;
+            bool isCurrent = resolveToolchain(version, useFX, archs, envs);
+#ifndef _WIN32
+            if (!winePrefix.empty())
+            {
+                // the tool path is baked in, so it needs the case on disk
+                DirectoryCache cache(cacheFile("envvc-dirs"));
+                directoryCache = &cache;
+                translateForWine(envs.front(), winePrefix);
+                cache.save();
+                directoryCache = 0;
+            }
+#endif
+            if (isHermetic)
+                makeHermetic(envs.front());
+            if (!isForced && !isCurrent)
+            {
+                cerr << "Please install the lastest Service Pack or use option '-f'" << endl;
+                exit(1);
+            }
+            return bake(envs.front(), version, tool, outName, rebakeCommand(allArgs));
+        }
+
+        if (string(argv[1]) == "diff")
+        {
+            // without a first version, from the toolchain the session has
+            string fromVersion = argc > 3 ? string(argv[2]) : string();
+            string toVersion = argc > 2 ? string(argv[argc > 3 ? 3 : 2]) : string();
+            if (argc > 4 || !isKnownVersion(toVersion)
+                || (!fromVersion.empty() && !isKnownVersion(fromVersion)))
+            {
+                printUsage();
+                exit(1);
+            }
+            if (archs.size() > 1)
+                throw runtime_error("diff needs a single architecture");
+#ifndef _WIN32
+            // cmd would edit the Unix form of PATH with %PATH:...%
+            if (!winePrefix.empty() && shell == shellCmd)
+                throw runtime_error("diff with --wine needs --shell sh or powershell");
+#endif
+
+            // only the toolchain entries, the rest of the lists stays as is
+            isInheriting = false;
+            vector<Environment> from;
+            vector<Environment> to;
+            bool isCurrent = true;
+            if (!fromVersion.empty())
+                isCurrent = resolveToolchain(fromVersion, useFX, archs, from);
+            isCurrent = resolveToolchain(toVersion, useFX, archs, to) && isCurrent;
+            {
+#ifndef _WIN32
+                DirectoryCache cache(cacheFile("envvc-dirs"));
+                directoryCache = &cache;
+#endif
+                if (fromVersion.empty())
+                    from.push_back(currentToolchain(useFX, archs));
+                else if (!winePrefix.empty())
+                    translateForWine(from.front(), winePrefix);
+                if (!winePrefix.empty())
+                    translateForWine(to.front(), winePrefix);
+#ifndef _WIN32
+                cache.save();
+                directoryCache = 0;
+#endif
+            }
+            if (!isForced && !isCurrent)
+            {
+                cerr << "Please install the lastest Service Pack or use option '-f'" << endl;
+                exit(1);
+            }
+            printDiff(from.front(), to.front(), shell);
+            return 0;
+        }
+
         string version(argv[1]);
-        bool isCurrent;
-        if (version == "6" || version == "60")
-            isCurrent = doVC6();
-        else if (version == "71")
-            isCurrent = doVC71();
-        else if (version == "80")
-            isCurrent = doVC80(useFX);
-        else if (version == "90")
-            isCurrent = doVC90();
-        else if (version == "100")
-            isCurrent = doVC100();
-        else
+        if (!isKnownVersion(version))
         {
             printUsage();
             exit(1);
         }
 
+        if (archs.size() > 1 && argc > 2)
+            throw runtime_error("a command can only be run for one architecture");
+
+        vector<Environment> envs;
+        bool isCurrent = resolveToolchain(version, useFX, archs, envs);
+        if (!winePrefix.empty())
+        {
+#ifndef _WIN32
+            DirectoryCache cache(cacheFile("envvc-dirs"));
+            directoryCache = &cache;
+#endif
+            for (vector<Environment>::iterator it = envs.begin(); it != envs.end(); ++it)
+                translateForWine(*it, winePrefix);
+#ifndef _WIN32
+            cache.save();
+            directoryCache = 0;
+#endif
+        }
+        if (isHermetic)
+        {
+            for (vector<Environment>::iterator it = envs.begin(); it != envs.end(); ++it)
+                makeHermetic(*it);
+        }
+
         if (useFX && version != "80")
         {
             cout << "Option 'fx' not supported for this version ("
@@ -186,7 +1345,61 @@ int main (int argc, char* argv[])
 
         if (argc > 2)
         {
-            retval = static_cast<int>(_spawnvp(_P_WAIT, argv[2], argv+2));
+            // before a complete environment drops MAKEFLAGS
+            JobServer jobServer;
+            // before a complete environment drops the cache directory
+            string prewarmFile;
+            if (isPrewarming)
+            {
+                prewarmFile = prewarmListFile(version, envs.front());
+                prewarm(prewarmList(envs.front(), version, prewarmFile));
+            }
+            envs.front().apply();
+
+            vector<char*> args(argv+2, argv+argc+1);
+            string mpOption;
+            limitParallelism(jobServer, args, mpOption);
+#ifdef _WIN32
+            runTimes.resolve = now() - started;
+            if (!logName.empty())
+            {
+                vector<string> includes;
+                retval = runLogged(&args[0], envs.front(), logName, logPrefix, logTime,
+                                   isPrewarming ? &includes : 0);
+                recordTimes(version, &args[0]);
+                learnIncludes(prewarmFile, includes);
+                return retval;
+            }
+
+            double spawned = now();
+            intptr_t child = _spawnvp(_P_NOWAIT, args[0], &args[0]);
+            runTimes.spawn = now() - spawned;
+            retval = -1;
+            if (child != -1 && _cwait(&retval, child, _WAIT_CHILD) != -1)
+            {
+                runTimes.child = now() - spawned - runTimes.spawn;
+                recordTimes(version, &args[0]);
+            }
+#else
+            runTimes.resolve = now() - started;
+            if (statsFile.empty() && !isPrewarming && mpOption.empty() && logName.empty())
+            {
+                // nothing left to do for us afterwards
+                retval = execvp(args[0], &args[0]);
+            }
+            else
+            {
+                // the jobserver tokens go back after the command
+                vector<string> includes;
+                retval = runTimed(&args[0], logName, logPrefix, logTime,
+                                  isPrewarming ? &includes : 0);
+                if (retval != -1)
+                {
+                    recordTimes(version, &args[0]);
+                    learnIncludes(prewarmFile, includes);
+                }
+            }
+#endif
             if (retval == -1)
             {
                 cout << "failed to execute " << argv[2] << ": errno " << errno << ", \""
@@ -195,7 +1408,13 @@ int main (int argc, char* argv[])
         }
         else
         {
-            cout << envCollection << endl;
+            for (vector<Environment>::const_iterator it = envs.begin(); it != envs.end(); ++it)
+            {
+                // only name the blocks if there is more than one
+                if (envs.size() > 1)
+                    cout << "[" << it->arch() << "]\n";
+                cout << it->str() << endl;
+            }
             retval = 0;
         }
     }
@@ -222,18 +1441,125 @@ int main (int argc, char* argv[])
 static void printUsage()
 {
     cout << banner
-         << "    usage: envvc [-v] [-f] [fx] 6|60|71|80|90 [command...]\n"
+         << "    usage: envvc [-v] [-f] [fx] [--reg file...|--wine prefix]\n"
+         << "                 [--arch a,b...]\n"
+         << "                 [--hermetic [--keep a,b...] [--extra-path dir...]]\n"
+         << "                 [--log file [--log-prefix text] [--log-time]] [--prewarm]\n"
+         << "                 6|60|71|80|90|100 [command...]\n"
+         << "           envvc [-f] [fx] [--arch a] [-j n] [--matrix-dir dir]\n"
+         << "                 --matrix v1,v2... command...\n"
+         << "           envvc [-f] [fx] [--reg file...|--wine prefix] [--arch a]\n"
+         << "                 [--shell cmd|sh|powershell] diff [from] to\n"
+         << "           envvc [-f] [fx] [--arch a] [--runs n] [--json] bench [v1 v2...]\n"
+         << "           envvc [-f] [fx] [--arch a] [--hermetic] bake version [tool] --out name\n"
+         << "           envvc stats [file]\n"
          << "    -v      : verbose. Print the detected compiler version.\n"
          << "    -f      : force execution even w/o the latest service pack\n"
          << "    fx      : use the .NET 3 SDK (formerly WinFX)\n"
+         << "    --reg   : read the registry from exported .reg files instead\n"
+         << "              (can be given several times)\n"
+         << "    --wine  : use the toolchain of a Wine prefix: reads its system.reg,\n"
+         << "              sets WINEPATH and puts the Unix form of its directories\n"
+         << "              in front of PATH (for running 'wine cl.exe'); the search\n"
+         << "              lists get the case of the directories on disk\n"
+         << "    --arch  : target architectures: x86 (default), amd64, x86_amd64\n"
+         << "              (several only without command, 80 and newer)\n"
+         << "    --log   : copy the output of the command to a log file\n"
+         << "    --log-prefix / --log-time : start each line in the log file\n"
+         << "              with the given text / the time of day\n"
+         << "    --matrix: run the command under each of the given versions\n"
+         << "    -j      : number of concurrent matrix runs (default: processors)\n"
+         << "    --matrix-dir : directory for the matrix output (envvc-matrix)\n"
          << "    command : command to execute within the changed environment\n"
+         << "              (inside a parallel GNU make, 'cl /MP' is limited to the\n"
+         << "              available jobserver tokens)\n"
+         << "    --hermetic : the command only gets the toolchain variables, the\n"
+         << "              directories of --extra-path (at the end of PATH), the\n"
+         << "              variables of --keep a,b... and a few system variables\n"
+         << "              (SystemRoot, TEMP...); ENVVC_HASH identifies the result;\n"
+         << "              with --wine, the directory of wine ends PATH\n"
+         << "    --prewarm : read the compiler binaries and the headers used most\n"
+         << "              by earlier runs (learned from cl /showIncludes in the\n"
+         << "              output of --log, or of the command with --wine) into the\n"
+         << "              file cache in the background\n"
+         << "    diff    : print the commands switching a session from one version\n"
+         << "              (default: the toolchain it has) to another, in the syntax\n"
+         << "              of --shell (default: cmd on Windows, sh otherwise); the\n"
+         << "              cmd commands are for a batch file (envvc diff 90 > s.bat)\n"
+         << "    bench   : compile bundled test sources with each version (default:\n"
+         << "              all) and print median/min times, as JSON with --json;\n"
+         << "              --runs: timed compiles per source after a warmup (5)\n"
+         << "    bake    : build a launcher that runs tool (default: cl) of the version\n"
+         << "              with its environment compiled in; it warns when the\n"
+         << "              toolchain changed after it was built\n"
+         << "    stats   : print percentiles of the times recorded for the commands\n"
+         << "              (recorded in the file named by ENVVC_STATS, if set)\n"
          << endl;
 }
 
 /*----------------------------------------------------------------------------*/
-static bool doVC6()
-{
-    string vc98    = trimmedString(studioDir + "6.0\\Setup\\Microsoft Visual C++",
+/**
+ * Resolves the environment of a Visual C++ version for all requested
+ * target architectures. The registry is only read once per call.
+ *
+ * @param version the version as given on the command line (e.g. "80")
+ * @param useFX   use the .NET 3 SDK (8.0 only)
+ * @param archs   the target architectures
+ * @param envs    receives one environment per architecture
+ *
+ * @return false if the installation lacks the current service pack
+ */
+static bool resolveToolchain(const std::string& version, bool useFX,
+                             const std::vector<const TargetArch*>& archs,
+                             std::vector<Environment>& envs)
+{
+    if (version == "6" || version == "60" || version == "71")
+    {
+        // no 64 bit compilers before Visual C++ 8.0
+        for (vector<const TargetArch*>::const_iterator it = archs.begin(); it != archs.end(); ++it)
+        {
+            if ((*it)->isCross || (*it)->isNative64)
+                throw runtime_error(string("architecture ") + (*it)->name
+                                    + " needs Visual C++ 8.0 or newer");
+        }
+        envs.push_back(Environment(archs.front()->name));
+        return version == "71" ? doVC71(envs.back()) : doVC6(envs.back());
+    }
+    else if (version == "80")
+        return doVC80(useFX, archs, envs);
+    else if (version == "90")
+        return doVC90(archs, envs);
+    else if (version == "100")
+        return doVC100(archs, envs);
+
+    throw runtime_error("unknown version " + version);
+}
+
+/*----------------------------------------------------------------------------*/
+static bool isKnownVersion(const std::string& version)
+{
+    return version == "6" || version == "60" || version == "71"
+        || version == "80" || version == "90" || version == "100";
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Looks up a target architecture by its vcvarsall name.
+ */
+static const TargetArch* findArch(const std::string& name)
+{
+    for (size_t i = 0; i < sizeof(targetArchs)/sizeof(targetArchs[0]); ++i)
+    {
+        if (name == targetArchs[i].name)
+            return &targetArchs[i];
+    }
+    throw runtime_error("unknown architecture " + name);
+}
+
+/*----------------------------------------------------------------------------*/
+static bool doVC6(Environment& env)
+{
+    string vc98    = trimmedString(studioDir + "6.0\\Setup\\Microsoft Visual C++",
                                    "ProductDir");
     string vsDir   = trimmedString(studioDir + "6.0\\Setup\\Microsoft Visual Studio",
                                    "ProductDir");
@@ -243,40 +1569,40 @@ static bool doVC6()
     // these are taken from
     // "C:\Programme\Microsoft Visual Studio\VC98\Bin\VCVARS32.BAT"
     // (but in the batch they are in the 8.3 shortened form...)
-    putEnv("MSDevDir", common6 + "\\msdev98");
-    putEnv("MSVCDir", vc98);
-
-    string oldpath = getEnv("PATH");
-    string oldinc = getEnv("INCLUDE");
-    string oldlib = getEnv("LIB");
-
-    string newpath
-        = common6 + "\\msdev98\\bin;"
-        + vc98 + "\\bin;"
-        + common6 + "\\tools\\winnt;"
-        + common6 + "\\tools;"
-        + oldpath;
-    string newinc
-        = vc98 + "\\atl\\include;"
-        + vc98 + "\\include;"
-        + vc98 + "\\mfc\\include;"
-        + oldinc;
-    string newlib
-        = vc98 + "\\lib;"
-        + vc98 + "\\mfc\\lib;"
-        + oldlib;
-    putEnv("PATH", newpath);
-    putEnv("INCLUDE", newinc);
-    putEnv("LIB", newlib);
+    env.set("MSDevDir", common6 + "\\msdev98");
+    env.set("MSVCDir", vc98);
+
+    string oldpath = inheritedList("PATH");
+    string oldinc = inheritedList("INCLUDE");
+    string oldlib = inheritedList("LIB");
+
+    PathList newpath;
+    newpath.add(common6, "\\msdev98\\bin")
+           .add(vc98, "\\bin")
+           .add(common6, "\\tools\\winnt")
+           .add(common6, "\\tools")
+           .addList(oldpath);
+    PathList newinc;
+    newinc.add(vc98, "\\atl\\include")
+          .add(vc98, "\\include")
+          .add(vc98, "\\mfc\\include")
+          .addList(oldinc);
+    PathList newlib;
+    newlib.add(vc98, "\\lib")
+          .add(vc98, "\\mfc\\lib")
+          .addList(oldlib);
+    env.set("PATH", newpath);
+    env.set("INCLUDE", newinc);
+    env.set("LIB", newlib);
 
     // these are new, but needed for v86.mak
-    putEnv("VCINSTALLDIR", vsDir);
-    putEnv("VC_VERS", "60");
+    env.set("VCINSTALLDIR", vsDir);
+    env.set("VC_VERS", "60");
 
     DWORD sp = 0;
     try {
-        sp = RegistryKey::getDword(studioDir + "6.0\\ServicePacks",
-                                   "latest");
+        sp = registry->getDword(studioDir + "6.0\\ServicePacks",
+                                "latest");
         compiler = "Visual C++ 6.0 SP " + string(1, static_cast<char>('0' + sp));
     }
     catch (runtime_error&)
@@ -288,8 +1614,9 @@ static bool doVC6()
     // versions!
     if (sp < 6)
     {
-        // make the message look like an error message...
-        cout << vsDir << "\\install.htm(1) : error SP: "
+        // make the message look like an error message (on stderr, stdout
+        // may be a script or JSON)...
+        cerr << vsDir << "\\install.htm(1) : error SP: "
              << "there's a newer service pack available!" << endl;
         return false;
     }
@@ -298,7 +1625,7 @@ static bool doVC6()
 }
 
 /*----------------------------------------------------------------------------*/
-static bool doVC71()
+static bool doVC71(Environment& env)
 {
     string instDir = trimmedString(studioDir + "7.1",
                                    "InstallDir");
@@ -319,54 +1646,56 @@ static bool doVC71()
 
     // these are taken from
     // "C:\Programme\Microsoft Visual Studio .NET 2003\Common7\Tools\vsvars32.bat"
-    putEnv("VSINSTALLDIR", instDir);
-    putEnv("VCINSTALLDIR", vsDir);
-    putEnv("FrameworkDir", clrRoot);
-    putEnv("FrameworkVersion", clrVers);
-    putEnv("FrameworkSDKDir", clrSdk);
-    putEnv("DevEnvDir", ideDir);
-    putEnv("MSVCDir", vc7);
-
-    string oldpath = getEnv("PATH");
-    string oldinc = getEnv("INCLUDE");
-    string oldlib = getEnv("LIB");
-
-    string newpath
-        = ideDir + ";"
-        + vc7 + "\\bin;"
-        + common7 + "\\tools;"
-        + common7 + "\\tools\\bin\\prerelease;"
-        + common7 + "\\tools\\bin;"
-        + clrSdk + "\\bin;"
-        + clrRoot + "\\" + clrVers + ";"
-        + oldpath;
-    string newinc
-        = vc7 + "\\atlmfc\\include;"
-        + vc7 + "\\include;"
-        + vc7 + "\\platformSDK\\include\\prerelease;"
-        + vc7 + "\\platformSDK\\include;"
-        + clrSdk + "\\include;"
-        + oldinc;
-    string newlib
-        = vc7 + "\\atlmfc\\lib;"
-        + vc7 + "\\lib;"
-        + vc7 + "\\platformSDK\\lib\\prerelease;"
-        + vc7 + "\\platformSDK\\lib;"
-        + clrSdk + "\\lib;"
-        + oldlib;
-    putEnv("PATH", newpath);
-    putEnv("INCLUDE", newinc);
-    putEnv("LIB", newlib);
+    env.set("VSINSTALLDIR", instDir);
+    env.set("VCINSTALLDIR", vsDir);
+    env.set("FrameworkDir", clrRoot);
+    env.set("FrameworkVersion", clrVers);
+    env.set("FrameworkSDKDir", clrSdk);
+    env.set("DevEnvDir", ideDir);
+    env.set("MSVCDir", vc7);
+
+    string oldpath = inheritedList("PATH");
+    string oldinc = inheritedList("INCLUDE");
+    string oldlib = inheritedList("LIB");
+
+    string clrDir = clrRoot + "\\" + clrVers;
+
+    PathList newpath;
+    newpath.add(ideDir)
+           .add(vc7, "\\bin")
+           .add(common7, "\\tools")
+           .add(common7, "\\tools\\bin\\prerelease")
+           .add(common7, "\\tools\\bin")
+           .add(clrSdk, "\\bin")
+           .add(clrDir)
+           .addList(oldpath);
+    PathList newinc;
+    newinc.add(vc7, "\\atlmfc\\include")
+          .add(vc7, "\\include")
+          .add(vc7, "\\platformSDK\\include\\prerelease")
+          .add(vc7, "\\platformSDK\\include")
+          .add(clrSdk, "\\include")
+          .addList(oldinc);
+    PathList newlib;
+    newlib.add(vc7, "\\atlmfc\\lib")
+          .add(vc7, "\\lib")
+          .add(vc7, "\\platformSDK\\lib\\prerelease")
+          .add(vc7, "\\platformSDK\\lib")
+          .add(clrSdk, "\\lib")
+          .addList(oldlib);
+    env.set("PATH", newpath);
+    env.set("INCLUDE", newinc);
+    env.set("LIB", newlib);
 
     // these are new, but needed for v86.mak
-    putEnv("VC_VERS", "71");
+    env.set("VC_VERS", "71");
 
     compiler = "Visual C++ 7.1";
 
     DWORD sp = 0;
     try {
-        sp = RegistryKey::getDword(studioDir + "7.1\\Setup\\Servicing",
-                                   "CurrentSPLevel");
+        sp = registry->getDword(studioDir + "7.1\\Setup\\Servicing",
+                                "CurrentSPLevel");
         if (sp > 0)
             compiler += " SP " + string(1, static_cast<char>('0' + sp));
         else
@@ -381,8 +1710,9 @@ static bool doVC71()
     // versions!
     if (sp < 1)
     {
-        // make the message look like an error message...
-        cout << vsDir << "\\install.htm(1) : error SP: "
+        // make the message look like an error message (on stderr, stdout
+        // may be a script or JSON)...
+        cerr << vsDir << "\\install.htm(1) : error SP: "
              << "there's a newer service pack available!" << endl;
         return false;
     }
@@ -391,7 +1721,9 @@ static bool doVC71()
 }
 
 /*----------------------------------------------------------------------------*/
-static bool doVC80(bool useFX)
+static bool doVC80(bool useFX,
+                   const std::vector<const TargetArch*>& archs,
+                   std::vector<Environment>& envs)
 {
     bool isExpress = false;
     string regDir = studioDir;
@@ -426,6 +1758,7 @@ static bool doVC80(bool useFX)
                                    "CLR Version");
     string clrRoot = trimmedString(msDir + ".NETFramework",
                                    "InstallRoot");
+    string clrRoot64 = clrRoot + "64";
     string clrSdk  = trimmedString(msDir + ".NETFramework",
                                    "sdkInstallRootv2.0");
 
@@ -433,68 +1766,89 @@ static bool doVC80(bool useFX)
         ? trimmedString(msDir + "Microsoft SDKs\\Windows", "CurrentInstallFolder")
         : "";
 
-    // these are taken from
-    // "C:\Programme\Microsoft Visual Studio 8\Common7\Tools\vsvars32.bat"
-    putEnv("VSINSTALLDIR", vsDir);
-    putEnv("VCINSTALLDIR", vc8);
-    putEnv("FrameworkDir", clrRoot);
-    putEnv("FrameworkVersion", clrVers);
-    putEnv("FrameworkSDKDir", clrSdk);
-    putEnv("DevEnvDir", ideDir);
+    string oldpath = inheritedList("PATH");
+    string oldinc = inheritedList("INCLUDE");
+    string oldlib = inheritedList("LIB");
 
-    string fxInc;
-    if (useFX)
+    for (vector<const TargetArch*>::const_iterator it = archs.begin(); it != archs.end(); ++it)
     {
+        const TargetArch& arch = **it;
+        const string& frameworkDir = arch.isNative64 ? clrRoot64 : clrRoot;
+        envs.push_back(Environment(arch.name));
+        Environment& env = envs.back();
+
         // these are taken from
-        // "C:\Program Files\Microsoft SDKs\Windows\v6.0\Bin\SetEnv.Cmd"
-        putEnv("MSSdk", msSdk);
-        putEnv("SdkTools", msSdk + "\\Bin");
-        putEnv("OSLibraries", msSdk + "\\Lib");
-        fxInc = msSdk + "\\Include;" + msSdk + "\\Include\\gl";
-        putEnv("OSIncludes", fxInc);
-        putEnv("VCTools", msSdk + "\\VC\\Bin");
-        putEnv("VCLibraries", msSdk + "\\VC\\Lib");
-        putEnv("VCIncludes", msSdk + "\\VC\\Include;" + msSdk + "\\VC\\Include\\Sys");
-        putEnv("ReferenceAssemblies", "%ProgramFiles%\\Reference Assemblies\\Microsoft\\WinFX\\v3.0");
-    }
-
-    string oldpath = getEnv("PATH");
-    string oldinc = getEnv("INCLUDE");
-    string oldlib = getEnv("LIB");
-
-    string newpath
-        = ideDir + ";"
-        + (useFX ? (msSdk + "\\bin;") : "")
-        + vc8 + "\\bin;"
-        + (useFX ? "" : (vc8 + "\\platformSDK\\bin;"))
-        + vc8 + "\\vcpackages;"
-        + common7 + "\\tools;"
-        + common7 + "\\tools\\bin;"
-        + clrSdk + "\\bin;"
-        + clrRoot + "\\" + clrVers + ";"
-        + oldpath;
-    string newinc
-        = (useFX ? (fxInc + ";") : "")
-        + vc8 + "\\atlmfc\\include;"
-        + vc8 + "\\include;"
-        + (useFX ? "" : (vc8 + "\\platformSDK\\include;"))
-        + clrSdk + "\\include;"
-        + oldinc;
-    string newlib
-        = (useFX ? (msSdk + "\\lib;") : "")
-        + vc8 + "\\atlmfc\\lib;"
-        + vc8 + "\\lib;"
-        + (useFX ? "" : (vc8 + "\\platformSDK\\lib;"))
-        + clrSdk + "\\lib;"
-        + oldlib;
-    putEnv("PATH", newpath);
-    putEnv("INCLUDE", newinc);
-    putEnv("LIB", newlib);
-
-    putEnv("LIBPATH", clrRoot + "\\" + clrVers);
+        // "C:\Programme\Microsoft Visual Studio 8\Common7\Tools\vsvars32.bat"
+        // (and vcvarsamd64.bat / vcvarsx86_amd64.bat for the 64 bit targets)
+        env.set("VSINSTALLDIR", vsDir);
+        env.set("VCINSTALLDIR", vc8);
+        env.set("FrameworkDir", frameworkDir);
+        env.set("FrameworkVersion", clrVers);
+        env.set("FrameworkSDKDir", clrSdk);
+        env.set("DevEnvDir", ideDir);
 
-    // these are new, but needed for v86.mak
-    putEnv("VC_VERS", "80");
+        string fxInc;
+        if (useFX)
+        {
+            // these are taken from
+            // "C:\Program Files\Microsoft SDKs\Windows\v6.0\Bin\SetEnv.Cmd"
+            env.set("MSSdk", msSdk);
+            env.set("SdkTools", msSdk + "\\Bin");
+            env.set("OSLibraries", msSdk + arch.sdkLib);
+            fxInc = msSdk + "\\Include;" + msSdk + "\\Include\\gl";
+            env.set("OSIncludes", fxInc);
+            env.set("VCTools", msSdk + "\\VC\\Bin");
+            env.set("VCLibraries", msSdk + "\\VC\\Lib");
+            env.set("VCIncludes", msSdk + "\\VC\\Include;" + msSdk + "\\VC\\Include\\Sys");
+            env.set("ReferenceAssemblies", "%ProgramFiles%\\Reference Assemblies\\Microsoft\\WinFX\\v3.0");
+        }
+
+        string clrDir = frameworkDir + "\\" + clrVers;
+
+        PathList newpath;
+        newpath.add(ideDir);
+        if (useFX)
+            newpath.add(msSdk, "\\bin");
+        newpath.add(vc8, arch.vcBin);
+        if (arch.isCross)
+            newpath.add(vc8, "\\bin");
+        if (!useFX && arch.isNative64)
+            newpath.add(vc8, "\\platformSDK\\bin\\win64\\amd64");
+        if (!useFX)
+            newpath.add(vc8, "\\platformSDK\\bin");
+        newpath.add(vc8, "\\vcpackages")
+               .add(common7, "\\tools")
+               .add(common7, "\\tools\\bin")
+               .add(clrSdk, "\\bin")
+               .add(clrDir)
+               .addList(oldpath);
+        PathList newinc;
+        if (useFX)
+            newinc.addList(fxInc);
+        newinc.add(vc8, "\\atlmfc\\include")
+              .add(vc8, "\\include");
+        if (!useFX)
+            newinc.add(vc8, "\\platformSDK\\include");
+        newinc.add(clrSdk, "\\include")
+              .addList(oldinc);
+        PathList newlib;
+        if (useFX)
+            newlib.add(msSdk, arch.sdkLib);
+        newlib.add(vc8, arch.atlmfcLib)
+              .add(vc8, arch.vcLib);
+        if (!useFX)
+            newlib.add(vc8, arch.platformSdkLib);
+        newlib.add(clrSdk, arch.vcLib)
+              .addList(oldlib);
+        env.set("PATH", newpath);
+        env.set("INCLUDE", newinc);
+        env.set("LIB", newlib);
+
+        env.set("LIBPATH", clrDir);
+
+        // these are new, but needed for v86.mak
+        env.set("VC_VERS", "80");
+    }
 
     compiler = isExpress
         ? "Visual C++ 2005 Express"
@@ -502,8 +1856,8 @@ static bool doVC80(bool useFX)
 
     DWORD sp = 0;
     try {
-        sp = RegistryKey::getDword(devDiv + "VS\\Servicing\\8.0",
-                                   "SP");
+        sp = registry->getDword(devDiv + "VS\\Servicing\\8.0",
+                                "SP");
         if (sp > 0)
             compiler += " SP " + string(1, static_cast<char>('0' + sp));
         else
@@ -518,8 +1872,9 @@ static bool doVC80(bool useFX)
     // versions!
     if (sp < 1)
     {
-        // make the message look like an error message...
-        cout << vc8 << "\\install.htm(1) : error SP: "
+        // make the message look like an error message (on stderr, stdout
+        // may be a script or JSON)...
+        cerr << vc8 << "\\install.htm(1) : error SP: "
              << "there's a newer service pack available!" << endl;
         return false;
     }
@@ -528,7 +1883,8 @@ static bool doVC80(bool useFX)
 }
 
 /*----------------------------------------------------------------------------*/
-static bool doVC90()
+static bool doVC90(const std::vector<const TargetArch*>& archs,
+                   std::vector<Environment>& envs)
 {
     bool isExpress = false;
     string regDir = studioDir;
@@ -563,84 +1919,101 @@ static bool doVC90()
                                    "CLR Version");
     string clrRoot = trimmedString(msDir + ".NETFramework",
                                    "InstallRoot");
+    string clrRoot64 = clrRoot + "64";
 //     string clrSdk  = trimmedString(msDir + ".NETFramework",
 //                                    "sdkInstallRootv2.0");
     string clr35   = "v3.5"; // @todo
 
     string msSdk = trimmedString(msDir + "Microsoft SDKs\\Windows", "CurrentInstallFolder");
 
-    // these are taken from
-    // "C:\Programme\Microsoft Visual Studio 9.0\Common7\Tools\vsvars32.bat"
-    putEnv("VSINSTALLDIR", vsDir);
-    putEnv("VCINSTALLDIR", vc9);
-    putEnv("FrameworkDir", clrRoot);
-    putEnv("FrameworkVersion", clrVers);
-    putEnv("Framework35Version", clr35);
-//    putEnv("FrameworkSDKDir", clrSdk);
-    putEnv("DevEnvDir", ideDir);
-
-//     string fxInc;
-//     if (useFX)
-//     {
-//         // these are taken from
-//         // "C:\Program Files\Microsoft SDKs\Windows\v6.0\Bin\SetEnv.Cmd"
-//         putEnv("MSSdk", msSdk);
-//         putEnv("SdkTools", msSdk + "\\Bin");
-//         putEnv("OSLibraries", msSdk + "\\Lib");
-//         fxInc = msSdk + "\\Include;" + msSdk + "\\Include\\gl";
-//         putEnv("OSIncludes", fxInc);
-//         putEnv("VCTools", msSdk + "\\VC\\Bin");
-//         putEnv("VCLibraries", msSdk + "\\VC\\Lib");
-//         putEnv("VCIncludes", msSdk + "\\VC\\Include;" + msSdk + "\\VC\\Include\\Sys");
-//         putEnv("ReferenceAssemblies", "%ProgramFiles%\\Reference Assemblies\\Microsoft\\WinFX\\v3.0");
-//     }
-
-    string oldpath = getEnv("PATH");
-    string oldinc = getEnv("INCLUDE");
-    string oldlib = getEnv("LIB");
-    string oldlibpath = getEnv("LIBPATH");
-
-    string newpath
-        = ideDir + ";"
-        + msSdk + "\\bin;"
-        + vc9 + "\\bin;"
-//        + (useFX ? "" : (vc9 + "\\platformSDK\\bin;"))
-        + common7 + "\\tools;"
-//        + common7 + "\\tools\\bin;"
-//        + clrSdk + "\\bin;"
-        + clrRoot + "\\" + clr35 + ";"
-        + clrRoot + "\\" + clrVers + ";"
-        + vc9 + "\\VCPackages;"
-        + oldpath;
-    string newinc
-//        = (useFX ? (fxInc + ";") : "")
-//        + vc9 + "\\atlmfc\\include;"
-        = vc9 + "\\include;"
-//        + (useFX ? "" : (vc9 + "\\platformSDK\\include;"))
-//        + clrSdk + "\\include;"
-        + oldinc;
-    string newlib
-        = msSdk + "\\lib;"
-//        + vc9 + "\\atlmfc\\lib;"
-        + vc9 + "\\lib;"
-//        + (useFX ? "" : (vc9 + "\\platformSDK\\lib;"))
-//        + clrSdk + "\\lib;"
-        + oldlib;
-    string newlibpath
-        = clrRoot + "\\" + clr35 + ";"
-        + clrRoot + "\\" + clrVers + ";"
-//        + vc9 + "\\atlmfc\\lib;"
-        + vc9 + "\\lib;"
-//        + (useFX ? "" : (vc9 + "\\platformSDK\\lib;"))
-//        + clrSdk + "\\lib;"
-        + oldlibpath;
-    putEnv("PATH", newpath);
-    putEnv("INCLUDE", newinc);
-    putEnv("LIB", newlib);
-    putEnv("LIBPATH", newlibpath);
+    string oldpath = inheritedList("PATH");
+    string oldinc = inheritedList("INCLUDE");
+    string oldlib = inheritedList("LIB");
+    string oldlibpath = inheritedList("LIBPATH");
 
-    // these are new, but needed for v86.mak
-    putEnv("VC_VERS", "90");
+    for (vector<const TargetArch*>::const_iterator it = archs.begin(); it != archs.end(); ++it)
+    {
+        const TargetArch& arch = **it;
+        const string& frameworkDir = arch.isNative64 ? clrRoot64 : clrRoot;
+        envs.push_back(Environment(arch.name));
+        Environment& env = envs.back();
+
+        // these are taken from
+        // "C:\Programme\Microsoft Visual Studio 9.0\Common7\Tools\vsvars32.bat"
+        // (and vcvarsamd64.bat / vcvarsx86_amd64.bat for the 64 bit targets)
+        env.set("VSINSTALLDIR", vsDir);
+        env.set("VCINSTALLDIR", vc9);
+        env.set("FrameworkDir", frameworkDir);
+        env.set("FrameworkVersion", clrVers);
+        env.set("Framework35Version", clr35);
+//        env.set("FrameworkSDKDir", clrSdk);
+        env.set("DevEnvDir", ideDir);
+
+//         string fxInc;
+//         if (useFX)
+//         {
+//             // these are taken from
+//             // "C:\Program Files\Microsoft SDKs\Windows\v6.0\Bin\SetEnv.Cmd"
+//             env.set("MSSdk", msSdk);
+//             env.set("SdkTools", msSdk + "\\Bin");
+//             env.set("OSLibraries", msSdk + "\\Lib");
+//             fxInc = msSdk + "\\Include;" + msSdk + "\\Include\\gl";
+//             env.set("OSIncludes", fxInc);
+//             env.set("VCTools", msSdk + "\\VC\\Bin");
+//             env.set("VCLibraries", msSdk + "\\VC\\Lib");
+//             env.set("VCIncludes", msSdk + "\\VC\\Include;" + msSdk + "\\VC\\Include\\Sys");
+//             env.set("ReferenceAssemblies", "%ProgramFiles%\\Reference Assemblies\\Microsoft\\WinFX\\v3.0");
+//         }
+
+        string clr35Dir = frameworkDir + "\\" + clr35;
+        string clrDir = frameworkDir + "\\" + clrVers;
+
+        PathList newpath;
+        newpath.add(ideDir);
+        if (arch.isNative64)
+            newpath.add(msSdk, "\\bin\\x64");
+        newpath.add(msSdk, "\\bin")
+               .add(vc9, arch.vcBin);
+        if (arch.isCross)
+            newpath.add(vc9, "\\bin");
+//        newpath.add(vc9, "\\platformSDK\\bin");
+        newpath.add(common7, "\\tools")
+//               .add(common7, "\\tools\\bin")
+//               .add(clrSdk, "\\bin")
+               .add(clr35Dir)
+               .add(clrDir)
+               .add(vc9, "\\VCPackages")
+               .addList(oldpath);
+        PathList newinc;
+//        newinc.addList(fxInc)
+//              .add(vc9, "\\atlmfc\\include");
+        newinc.add(vc9, "\\include")
+//              .add(vc9, "\\platformSDK\\include")
+//              .add(clrSdk, "\\include")
+              .addList(oldinc);
+        PathList newlib;
+        newlib.add(msSdk, arch.sdkLib)
+//              .add(vc9, arch.atlmfcLib)
+              .add(vc9, arch.vcLib)
+//              .add(vc9, arch.platformSdkLib)
+//              .add(clrSdk, arch.sdkLib)
+              .addList(oldlib);
+        PathList newlibpath;
+        newlibpath.add(clr35Dir)
+                  .add(clrDir)
+//                  .add(vc9, arch.atlmfcLib)
+                  .add(vc9, arch.vcLib)
+//                  .add(vc9, arch.platformSdkLib)
+//                  .add(clrSdk, arch.sdkLib)
+                  .addList(oldlibpath);
+        env.set("PATH", newpath);
+        env.set("INCLUDE", newinc);
+        env.set("LIB", newlib);
+        env.set("LIBPATH", newlibpath);
+
+        // these are new, but needed for v86.mak
+        env.set("VC_VERS", "90");
+    }
 
     compiler = isExpress
         ? "Visual C++ 2008 Express"
@@ -648,14 +2021,14 @@ static bool doVC90()
 
     DWORD sp = 0;
     try {
-        sp = RegistryKey::getDword(devDiv + "VS\\Servicing\\9.0",
-                                   "SP");
+        sp = registry->getDword(devDiv + "VS\\Servicing\\9.0",
+                                "SP");
     }
     catch (runtime_error&)
     {
         try {
-            sp = RegistryKey::getDword(devDiv + "VC\\Servicing\\9.0",
-                                       "SP");
+            sp = registry->getDword(devDiv + "VC\\Servicing\\9.0",
+                                    "SP");
         }
         catch (runtime_error&)
         {
@@ -670,8 +2043,9 @@ static bool doVC90()
     // versions!
     if (sp < 1)
     {
-        // make the message look like an error message...
-        cout << vc9 << "\\install.htm(1) : error SP: "
+        // make the message look like an error message (on stderr, stdout
+        // may be a script or JSON)...
+        cerr << vc9 << "\\install.htm(1) : error SP: "
              << "there's a newer service pack available!" << endl;
         return false;
     }
@@ -680,7 +2054,8 @@ static bool doVC90()
 }
 
 /*----------------------------------------------------------------------------*/
-static bool doVC100()
+static bool doVC100(const std::vector<const TargetArch*>& archs,
+                    std::vector<Environment>& envs)
 {
     bool isExpress = true;
     string regDir = expressDir;
@@ -715,6 +2090,7 @@ static bool doVC100()
                                    "CLR Version");
     string clrRoot = trimmedString(msDir + ".NETFramework",
                                    "InstallRoot");
+    string clrRoot64 = clrRoot + "64";
     string clrSdk  = trimmedString(msDir + ".NETFramework",
                                    "sdkInstallRootv2.0");
     string clr35   = "v3.5"; // @todo
@@ -722,88 +2098,107 @@ static bool doVC100()
     // note that VCVarsQueryRegistry.bat explicity tests for v7.0A
     string msSdk = trimmedString(msDir + "Microsoft SDKs\\Windows", "CurrentInstallFolder");
 
-    // these are taken from
-    // "C:\Programme\Microsoft Visual Studio 10.0\Common7\Tools\vsvars32.bat"
-    // and
-    // "C:\Programme\Microsoft Visual Studio 10.0\Common7\Tools\VCVarsQueryRegistry.bat"
-    putEnv("VSINSTALLDIR", vsDir);
-    putEnv("VCINSTALLDIR", vc10);
-    putEnv("VC100COMNTOOLS", vc10);
-    putEnv("FrameworkDir", clrRoot);
-    putEnv("FrameworkDIR32", clrRoot);
-    putEnv("FrameworkVersion", clrVers);
-    putEnv("FrameworkVersion32", clrVers);
-    putEnv("Framework35Version", clr35);
-//    putEnv("FrameworkSDKDir", clrSdk);
-    putEnv("WindowsSdkDir", msSdk);
-    putEnv("DevEnvDir", ideDir);
-
-//     string fxInc;
-//     if (useFX)
-//     {
-//         // these are taken from
-//         // "C:\Program Files\Microsoft SDKs\Windows\v6.0\Bin\SetEnv.Cmd"
-//         putEnv("MSSdk", msSdk);
-//         putEnv("SdkTools", msSdk + "\\Bin");
-//         putEnv("OSLibraries", msSdk + "\\Lib");
-//         fxInc = msSdk + "\\Include;" + msSdk + "\\Include\\gl";
-//         putEnv("OSIncludes", fxInc);
-//         putEnv("VCTools", msSdk + "\\VC\\Bin");
-//         putEnv("VCLibraries", msSdk + "\\VC\\Lib");
-//         putEnv("VCIncludes", msSdk + "\\VC\\Include;" + msSdk + "\\VC\\Include\\Sys");
-//         putEnv("ReferenceAssemblies", "%ProgramFiles%\\Reference Assemblies\\Microsoft\\WinFX\\v3.0");
-//     }
-
-    string oldpath = getEnv("PATH");
-    string oldinc = getEnv("INCLUDE");
-    string oldlib = getEnv("LIB");
-    string oldlibpath = getEnv("LIBPATH");
-
-    string newpath
-        = ideDir + ";"
-//        + msSdk + "\\bin;"
-        + vc10 + "\\bin;"
-//        + (useFX ? "" : (vc10 + "\\platformSDK\\bin;"))
-        + common7 + "\\tools;"
-//        + common7 + "\\tools\\bin;"
-//        + clrSdk + "\\bin;"
-        + clrRoot + "\\" + clrVers + ";"
-        + clrRoot + "\\" + clr35 + ";"
-        + vc10 + "\\VCPackages;"
-        + msSdk + "\\bin\\NETFX 4.0 Tools;"
-        + msSdk + "\\bin;"
-        + oldpath;
-    string newinc
-//        = (useFX ? (fxInc + ";") : "")
-//        + vc10 + "\\atlmfc\\include;"
-        = vc10 + "\\include;"
-        + msSdk + "\\include;"
-//        + (useFX ? "" : (vc10 + "\\platformSDK\\include;"))
-//        + clrSdk + "\\include;"
-        + oldinc;
-    string newlib
-        = msSdk + "\\lib;"
-//        + vc10 + "\\atlmfc\\lib;"
-        + vc10 + "\\lib;"
-        + msSdk + "\\lib;"
-//        + (useFX ? "" : (vc10 + "\\platformSDK\\lib;"))
-//        + clrSdk + "\\lib;"
-        + oldlib;
-    string newlibpath
-        = clrRoot + "\\" + clr35 + ";"
-        + clrRoot + "\\" + clrVers + ";"
-//        + vc10 + "\\atlmfc\\lib;"
-        + vc10 + "\\lib;"
-//        + (useFX ? "" : (vc10 + "\\platformSDK\\lib;"))
-//        + clrSdk + "\\lib;"
-        + oldlibpath;
-    putEnv("PATH", newpath);
-    putEnv("INCLUDE", newinc);
-    putEnv("LIB", newlib);
-    putEnv("LIBPATH", newlibpath);
+    string oldpath = inheritedList("PATH");
+    string oldinc = inheritedList("INCLUDE");
+    string oldlib = inheritedList("LIB");
+    string oldlibpath = inheritedList("LIBPATH");
 
-    // these are new, but needed for v86.mak
-    putEnv("VC_VERS", "100");
+    for (vector<const TargetArch*>::const_iterator it = archs.begin(); it != archs.end(); ++it)
+    {
+        const TargetArch& arch = **it;
+        const string& frameworkDir = arch.isNative64 ? clrRoot64 : clrRoot;
+        envs.push_back(Environment(arch.name));
+        Environment& env = envs.back();
+
+        // these are taken from
+        // "C:\Programme\Microsoft Visual Studio 10.0\Common7\Tools\vsvars32.bat"
+        // and
+        // "C:\Programme\Microsoft Visual Studio 10.0\Common7\Tools\VCVarsQueryRegistry.bat"
+        // (and vcvars64.bat / vcvarsx86_amd64.bat for the 64 bit targets)
+        env.set("VSINSTALLDIR", vsDir);
+        env.set("VCINSTALLDIR", vc10);
+        env.set("VC100COMNTOOLS", vc10);
+        env.set("FrameworkDir", frameworkDir);
+        env.set(arch.isNative64 ? "FrameworkDIR64" : "FrameworkDIR32", frameworkDir);
+        env.set("FrameworkVersion", clrVers);
+        env.set(arch.isNative64 ? "FrameworkVersion64" : "FrameworkVersion32", clrVers);
+        env.set("Framework35Version", clr35);
+//        env.set("FrameworkSDKDir", clrSdk);
+        env.set("WindowsSdkDir", msSdk);
+        env.set("DevEnvDir", ideDir);
+
+//         string fxInc;
+//         if (useFX)
+//         {
+//             // these are taken from
+//             // "C:\Program Files\Microsoft SDKs\Windows\v6.0\Bin\SetEnv.Cmd"
+//             env.set("MSSdk", msSdk);
+//             env.set("SdkTools", msSdk + "\\Bin");
+//             env.set("OSLibraries", msSdk + "\\Lib");
+//             fxInc = msSdk + "\\Include;" + msSdk + "\\Include\\gl";
+//             env.set("OSIncludes", fxInc);
+//             env.set("VCTools", msSdk + "\\VC\\Bin");
+//             env.set("VCLibraries", msSdk + "\\VC\\Lib");
+//             env.set("VCIncludes", msSdk + "\\VC\\Include;" + msSdk + "\\VC\\Include\\Sys");
+//             env.set("ReferenceAssemblies", "%ProgramFiles%\\Reference Assemblies\\Microsoft\\WinFX\\v3.0");
+//         }
+
+        string clr35Dir = frameworkDir + "\\" + clr35;
+        string clrDir = frameworkDir + "\\" + clrVers;
+
+        PathList newpath;
+        newpath.add(ideDir)
+//               .add(msSdk, "\\bin")
+               .add(vc10, arch.vcBin);
+        if (arch.isCross)
+            newpath.add(vc10, "\\bin");
+//        newpath.add(vc10, "\\platformSDK\\bin");
+        newpath.add(common7, "\\tools")
+//               .add(common7, "\\tools\\bin")
+//               .add(clrSdk, "\\bin")
+               .add(clrDir)
+               .add(clr35Dir)
+               .add(vc10, "\\VCPackages");
+        if (arch.isNative64)
+        {
+            newpath.add(msSdk, "\\bin\\NETFX 4.0 Tools\\x64")
+                   .add(msSdk, "\\bin\\x64");
+        }
+        newpath.add(msSdk, "\\bin\\NETFX 4.0 Tools")
+               .add(msSdk, "\\bin")
+               .addList(oldpath);
+        PathList newinc;
+//        newinc.addList(fxInc)
+//              .add(vc10, "\\atlmfc\\include");
+        newinc.add(vc10, "\\include")
+              .add(msSdk, "\\include")
+//              .add(vc10, "\\platformSDK\\include")
+//              .add(clrSdk, "\\include")
+              .addList(oldinc);
+        PathList newlib;
+        newlib.add(msSdk, arch.sdkLib)
+//              .add(vc10, arch.atlmfcLib)
+              .add(vc10, arch.vcLib)
+              .add(msSdk, arch.sdkLib)
+//              .add(vc10, arch.platformSdkLib)
+//              .add(clrSdk, arch.sdkLib)
+              .addList(oldlib);
+        PathList newlibpath;
+        newlibpath.add(clr35Dir)
+                  .add(clrDir)
+//                  .add(vc10, arch.atlmfcLib)
+                  .add(vc10, arch.vcLib)
+//                  .add(vc10, arch.platformSdkLib)
+//                  .add(clrSdk, arch.sdkLib)
+                  .addList(oldlibpath);
+        env.set("PATH", newpath);
+        env.set("INCLUDE", newinc);
+        env.set("LIB", newlib);
+        env.set("LIBPATH", newlibpath);
+
+        // these are new, but needed for v86.mak
+        env.set("VC_VERS", "100");
+    }
 
     compiler = isExpress
         ? "Visual C++ 2010 Express"
@@ -812,6 +2207,139 @@ static bool doVC100()
     return true;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the lower case name of the program a command runs, like "cl" for
+ *         "C:\path\CL.EXE" or for "wine C:\path\CL.EXE"
+ */
+static std::string programName(char* const* args)
+{
+    string name;
+    for (char* const* arg = args; *arg != 0; ++arg)
+    {
+        name = *arg;
+        string::size_type slash = name.find_last_of("\\/:");
+        if (slash != string::npos)
+            name.erase(0, slash + 1);
+        if (name.size() > 4 && _stricmp(name.c_str() + name.size() - 4, ".exe") == 0)
+            name.erase(name.size() - 4);
+        for (string::iterator it = name.begin(); it != name.end(); ++it)
+            *it = static_cast<char>(tolower(static_cast<unsigned char>(*it)));
+        // the Wine loader runs the Windows program after it
+        if (name != "wine" && name != "wine64")
+            break;
+    }
+    return name;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the jobserver announced in MAKEFLAGS, or an empty string
+ */
+static std::string jobServerName()
+{
+    string makeflags = getEnv("MAKEFLAGS");
+
+    // --jobserver-fds is the name used by GNU make before 4.2; with
+    // recursive makes the last one is ours
+    const char* const options[] = { "--jobserver-auth=", "--jobserver-fds=" };
+    string name;
+    for (size_t i = 0; i < sizeof(options)/sizeof(options[0]) && name.empty(); ++i)
+    {
+        string::size_type pos = makeflags.rfind(options[i]);
+        if (pos == string::npos)
+            continue;
+        pos += strlen(options[i]);
+        name = makeflags.substr(pos, makeflags.find(' ', pos) - pos);
+    }
+    return name;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Adjusts the /MP option of a cl command line to the number of jobs the
+ * make jobserver grants us (our own implicit token plus the acquired ones).
+ * cl doesn't know the jobserver protocol, so without this each cl /MP
+ * would start one compiler per core in addition to make's own jobs.
+ *
+ * @param jobServer the jobserver to take the tokens from
+ * @param args      NULL terminated argument vector of the command
+ * @param storage   keeps the rewritten option alive
+ */
+static void limitParallelism(JobServer& jobServer,
+                             std::vector<char*>& args,
+                             std::string& storage)
+{
+    if (!jobServer.isActive() || args.size() < 2 || programName(&args[0]) != "cl")
+        return;
+
+    // cl uses the last /MP, so only that one is rewritten (and the tokens
+    // are only taken once)
+    vector<char*>::iterator option = args.end();
+    for (vector<char*>::iterator it = args.begin() + 1; *it != 0; ++it)
+    {
+        const char* arg = *it;
+        if ((arg[0] == '/' || arg[0] == '-') && strncmp(arg + 1, "MP", 2) == 0)
+            option = it;
+    }
+    if (option == args.end())
+        return;
+
+    const char* arg = *option;
+    unsigned wanted = 0;
+    if (arg[3] == '\0')
+    {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        wanted = info.dwNumberOfProcessors;
+#else
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        wanted = processors > 0 ? static_cast<unsigned>(processors) : 1;
+#endif
+    }
+    else
+    {
+        char* end = 0;
+        wanted = static_cast<unsigned>(strtoul(arg + 3, &end, 10));
+        if (*end != '\0')
+            return;
+    }
+
+    unsigned jobs = 1 + (wanted > 1 ? jobServer.acquire(wanted - 1) : 0);
+    char buffer[16];
+    sprintf(buffer, "%u", jobs);
+    storage = string(arg, 3) + buffer;
+    *option = &storage[0];
+}
+
+#ifdef _WIN32
+/*----------------------------------------------------------------------------*/
+/**
+ * Gives the jobserver tokens back when the console is closed or the user
+ * presses Ctrl-C, otherwise the outer make would lose them for good.
+ */
+static BOOL WINAPI onConsoleCtrl(DWORD /*ctrlType*/)
+{
+    if (activeJobServer)
+        activeJobServer->release();
+    return FALSE;
+}
+#else
+/*----------------------------------------------------------------------------*/
+/**
+ * Gives the jobserver tokens back on Ctrl-C and the like, then dies of the
+ * signal as make expects.
+ */
+static void onSignal(int signal)
+{
+    if (activeJobServer)
+        activeJobServer->release();
+    ::signal(signal, SIG_DFL);
+    raise(signal);
+}
+#endif
+
 /*----------------------------------------------------------------------------*/
 /**
  * Reads a registry value and chops off trailing blanks and backslashes
@@ -824,7 +2352,7 @@ static bool doVC100()
 static std::string trimmedString(const std::string& key,
                                  const std::string& valueName)
 {
-    std::string result = RegistryKey::getString(key, valueName);
+    std::string result = registry->getString(key, valueName);
 
     // chop off trailing blanks and backslashes
     string::size_type size = result.find_last_not_of("\\ ");
@@ -851,17 +2379,3596 @@ static std::string getEnv(const std::string& var)
 }
 
 /*----------------------------------------------------------------------------*/
-static void putEnv(const std::string& var, const std::string& value)
+/**
+ * @return the current value of a search list that the toolchain entries
+ *         are put in front of
+ */
+static std::string inheritedList(const std::string& var)
+{
+    // our own PATH is a Unix one outside Windows
+#ifdef _WIN32
+    if (!isInheriting)
+#else
+    if (!isInheriting || var == "PATH")
+#endif
+        return string();
+
+    return getEnv(var);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Splits a list like "x86,amd64" into its non-empty elements.
+ */
+static std::vector<std::string> splitList(const std::string& list, char separator)
+{
+    vector<string> result;
+    string::size_type start = 0;
+    while (start <= list.size())
+    {
+        string::size_type end = list.find(separator, start);
+        if (end == string::npos)
+            end = list.size();
+        if (end > start)
+            result.push_back(list.substr(start, end - start));
+        start = end + 1;
+    }
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the separator of the search list @a var in a resolved
+ *         environment: ':' for PATH in the Wine mode, where it has the
+ *         Unix form (see translateForWine()), ';' otherwise
+ */
+static char listSeparator(const std::string& var)
+{
+#ifndef _WIN32
+    if (!winePrefix.empty() && _stricmp(var.c_str(), "PATH") == 0)
+        return ':';
+#endif
+    return ';';
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Continues an FNV-1a hash with @a size bytes.
+ *
+ * @param hash fnvBasis, or the hash of the preceding data
+ */
+static unsigned fnvHash(unsigned hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * fnvPrime;
+    return hash;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return whether an entry of a Wine environment depends on where the
+ *         prefix is: the Unix PATH (WINEPATH has the Windows form) and
+ *         WINEPREFIX
+ */
+static bool isPrefixDependent(const std::string& entry)
+{
+    return _strnicmp(entry.c_str(), "PATH=", 5) == 0
+        || _strnicmp(entry.c_str(), "WINEPREFIX=", 11) == 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Turns a resolved environment into the complete environment of the
+ * command (--hermetic): the toolchain entries, the directories of
+ * --extra-path at the end of PATH, ENVVC_HASH and the inherited variables
+ * of the allowlist. ENVVC_HASH only covers the entries envvc defines, so
+ * it is the same on all machines with the same installation. In the Wine
+ * mode it covers the Windows form of the directories (WINEPATH, not the
+ * Unix PATH and WINEPREFIX, which depend on where the prefix is) and the
+ * directories of --extra-path, and the directory of wine (/usr/bin:/bin
+ * if it isn't in our PATH) ends PATH.
+ */
+static void makeHermetic(Environment& env)
+{
+    if (!extraDirs.empty())
+    {
+        string path = env.get("PATH");
+        for (vector<string>::const_iterator it = extraDirs.begin(); it != extraDirs.end(); ++it)
+        {
+            if (!path.empty())
+                path += listSeparator("PATH");
+            path += *it;
+        }
+        env.set("PATH", path);
+    }
+
+    vector<string> hashed(env.entries());
+    if (!winePrefix.empty())
+    {
+        hashed.erase(std::remove_if(hashed.begin(), hashed.end(), isPrefixDependent),
+                     hashed.end());
+        hashed.insert(hashed.end(), extraDirs.begin(), extraDirs.end());
+    }
+    unsigned hash = fnvBasis;
+    for (vector<string>::const_iterator it = hashed.begin(); it != hashed.end(); ++it)
+    {
+        // the terminating '\0' separates the entries
+        hash = fnvHash(hash, it->c_str(), it->size() + 1);
+    }
+    char hashText[16];
+    sprintf(hashText, "%08x", hash);
+    env.set("ENVVC_HASH", hashText);
+
+#ifndef _WIN32
+    if (!winePrefix.empty())
+    {
+        // the command still has to find wine itself; its directory differs
+        // between machines, so it is not part of the hash
+        string wine = findWine();
+        string path = env.get("PATH");
+        if (!path.empty())
+            path += ':';
+        path += wine.empty() ? string("/usr/bin:/bin") : wine.substr(0, wine.rfind('/'));
+        env.set("PATH", path);
+    }
+#endif
+
+    for (vector<string>::const_iterator it = keptVars.begin(); it != keptVars.end(); ++it)
+    {
+        string value = getEnv(*it);
+        if (!value.empty() && env.get(*it).empty())
+            env.set(*it, value);
+    }
+    env.setComplete();
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Removes all variables from the environment of this process.
+ */
+static void clearEnvironment()
+{
+    vector<string> names;
+#ifdef _WIN32
+    char* strings = GetEnvironmentStrings();
+    for (const char* entry = strings; *entry != '\0'; entry += strlen(entry) + 1)
+    {
+        // the hidden "=C:" variables keep the current directories
+        const char* equal = strchr(entry, '=');
+        if (*entry != '=' && equal != 0)
+            names.push_back(string(entry, equal - entry));
+    }
+    FreeEnvironmentStrings(strings);
+
+    for (vector<string>::const_iterator it = names.begin(); it != names.end(); ++it)
+        _putenv((*it + "=").c_str());
+#else
+    for (char** entry = environ; *entry != 0; ++entry)
+    {
+        const char* equal = strchr(*entry, '=');
+        if (equal != 0)
+            names.push_back(string(*entry, equal - *entry));
+    }
+
+    for (vector<string>::const_iterator it = names.begin(); it != names.end(); ++it)
+        unsetenv(it->c_str());
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*-----------------------------------------------------------------------------+
+|   Wine functions                                                             |
++-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Uses the registry of a Wine prefix (as in WINEPREFIX) directly, without
+ * starting Wine.
+ */
+static void loadWinePrefix(RegFileRegistry& regFiles, const std::string& prefix)
+{
+    regFiles.load(prefix + "/system.reg", "HKEY_LOCAL_MACHINE\\");
+    try {
+        regFiles.load(prefix + "/user.reg", "HKEY_CURRENT_USER\\");
+    }
+    catch (runtime_error&)
+    {
+        // not needed for the toolchains, a fresh prefix might not have it
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Translates a Windows path of the Wine prefix to the Unix path, using
+ * the drive symlinks in dosdevices (c: -> ../drive_c, z: -> /).
+ *
+ * @return the Unix path, or an empty string if the drive is not mapped
+ */
+static std::string unixPath(const std::string& prefix,
+                            const std::string& windowsPath)
+{
+    if (windowsPath.size() < 2 || windowsPath[1] != ':')
+        return string();
+
+    string drive(1, static_cast<char>(tolower(static_cast<unsigned char>(windowsPath[0]))));
+    drive += ':';
+
+#ifdef _WIN32
+    // Wine itself maps the paths when envvc runs inside of it
+    string target;
+#else
+    // a handful of drives at most, but many paths per drive
+    static std::map<string, string> drives;
+    std::map<string, string>::iterator found = drives.find(drive);
+    if (found == drives.end())
+    {
+        string dosdevices = prefix + "/dosdevices/";
+        char buffer[4096];
+        ssize_t len = readlink((dosdevices + drive).c_str(), buffer, sizeof(buffer) - 1);
+        string target;
+        if (len > 0)
+        {
+            target.assign(buffer, len);
+            if (target.compare(0, 3, "../") == 0)
+                target = prefix + target.substr(2);
+            else if (target[0] != '/')
+                target = dosdevices + target;
+            if (target.size() > 1 && target[target.size() - 1] == '/')
+                target.erase(target.size() - 1);
+        }
+        found = drives.insert(std::make_pair(drive, target)).first;
+    }
+    string target = found->second;
+#endif
+    if (target.empty())
+        return string();
+
+    string rest = windowsPath.substr(2);
+    std::replace(rest.begin(), rest.end(), '\\', '/');
+    if (target == "/" && !rest.empty() && rest[0] == '/')
+        return rest;
+    return target + rest;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Changes the case of a Windows path of the Wine prefix to the one of the
+ * files on disk.
+ *
+ * @param windowsPath the path to change
+ * @param path        its Unix form from unixPath(), changed as well below
+ *                    the directory the drive maps to
+ */
+static void canonicalCase(std::string& windowsPath, std::string& path)
+{
+#ifndef _WIN32
+    // the path below the drive, the end of the Unix path maps 1:1
+    string::size_type size = windowsPath.size() - 2;
+    if (directoryCache == 0 || size == 0 || path.size() < size
+        || !directoryCache->canonical(path, path.size() - size + 1))
+        return;
+
+    string tail = path.substr(path.size() - size);
+    std::replace(tail.begin(), tail.end(), '/', '\\');
+    windowsPath.replace(2, size, tail);
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Prepares a resolved environment for running the tools with Wine: the
+ * Windows form of PATH goes to WINEPATH (which Wine prepends to the PATH
+ * of its processes), PATH gets the Unix form of the same directories in
+ * front of our own PATH. The directories of all search lists get the case
+ * they have on disk. WINEPREFIX makes wine use the prefix they are from.
+ */
+static void translateForWine(Environment& env, const std::string& prefix)
+{
+    string path;
+    for (size_t i = 0; i < sizeof(searchLists) / sizeof(searchLists[0]); ++i)
+    {
+        string value = env.get(searchLists[i]);
+        if (value.empty())
+            continue;
+
+        bool isPath = strcmp(searchLists[i], "PATH") == 0;
+        string windowsValue;
+        vector<string> dirs = splitList(value, ';');
+        for (vector<string>::iterator it = dirs.begin(); it != dirs.end(); ++it)
+        {
+            string dir = unixPath(prefix, *it);
+            if (!dir.empty())
+            {
+                canonicalCase(*it, dir);
+                if (isPath)
+                {
+                    path += dir;
+                    path += ':';
+                }
+            }
+            if (!windowsValue.empty())
+                windowsValue += ';';
+            windowsValue += *it;
+        }
+        env.set(isPath ? "WINEPATH" : searchLists[i], windowsValue);
+    }
+    if (isInheriting)
+        path += getEnv("PATH");
+    else if (!path.empty())
+        path.erase(path.size() - 1);
+    env.set("PATH", path);
+
+    // the drive paths above are the ones of this prefix
+    env.set("WINEPREFIX", prefix);
+}
+
+#ifndef _WIN32
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the full path of wine in our own PATH, or an empty string
+ */
+static std::string findWine()
+{
+    vector<string> dirs = splitList(getEnv("PATH"), ':');
+    for (vector<string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it)
+    {
+        string path = *it + "/wine";
+        if ((*it)[0] == '/' && access(path.c_str(), X_OK) == 0)
+            return path;
+    }
+    return string();
+}
+#endif
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the path of a file kept between runs (the directory listings,
+ *         the prewarm lists), or an empty string if there is no cache
+ *         directory
+ */
+static std::string cacheFile(const std::string& name)
 {
-    string putStr = var + "=" + value;
-    if (_putenv(putStr.c_str()) != 0)
-        throw runtime_error("_putenv failed");
+#ifdef _WIN32
+    string dir = getEnv("LOCALAPPDATA");
+    if (dir.empty())
+        dir = getEnv("TEMP");
+    if (dir.empty())
+        return string();
+    return dir + "\\" + name;
+#else
+    string dir = getEnv("XDG_CACHE_HOME");
+    if (dir.empty())
+    {
+        dir = getEnv("HOME");
+        if (dir.empty())
+            return string();
+        dir += "/.cache";
+    }
+    return dir + "/" + name;
+#endif
+}
 
-    envCollection += putStr + "\n";
+/*----------------------------------------------------------------------------*/
+
+/*-----------------------------------------------------------------------------+
+|   statistics functions                                                       |
++-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return a monotonic time in seconds
+ */
+static double now()
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return static_cast<double>(counter.QuadPart) / frequency.QuadPart;
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Copies output of a command for the log file, starting each line with
+ * @a prefix and the time of day.
+ *
+ * @param atLineStart whether @a data starts a line, updated for the next
+ *                    chunk
+ * @param out         gets the annotated text (cleared first)
+ */
+static void annotateLines(const char* data, size_t size,
+                          const std::string& prefix, bool withTime,
+                          bool& atLineStart, std::string& out)
+{
+    out.clear();
+    for (const char* p = data, *end = data + size; p != end; )
+    {
+        if (atLineStart)
+        {
+            out += prefix;
+            if (withTime)
+            {
+                char stamp[16];
+#ifdef _WIN32
+                SYSTEMTIME now;
+                GetLocalTime(&now);
+                sprintf(stamp, "%02d:%02d:%02d.%03d ",
+                        now.wHour, now.wMinute, now.wSecond, now.wMilliseconds);
+#else
+                struct timeval now;
+                gettimeofday(&now, 0);
+                struct tm local;
+                localtime_r(&now.tv_sec, &local);
+                sprintf(stamp, "%02d:%02d:%02d.%03d ", local.tm_hour, local.tm_min,
+                        local.tm_sec, static_cast<int>(now.tv_usec / 1000));
+#endif
+                out += stamp;
+            }
+        }
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        const char* next = eol ? eol + 1 : end;
+        out.append(p, next);
+        atLineStart = eol != 0;
+        p = next;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Appends the times of the run to the statistics file named by ENVVC_STATS
+ * (if set). Every run adds one short line with a single write to the file
+ * opened for appending, so concurrent runs neither lock nor mix their lines.
+ *
+ * @param version the toolchain version as given on the command line
+ * @param args    NULL terminated argument vector of the command; with the
+ *                Wine loader the times go to the Windows program it runs
+ */
+static void recordTimes(const std::string& version, char* const* args)
+{
+    const string& fileName = statsFile;
+    if (fileName.empty())
+        return;
+
+    string name = programName(args);
+    for (string::iterator it = name.begin(); it != name.end(); ++it)
+    {
+        if (isspace(static_cast<unsigned char>(*it)))
+            *it = '_';
+    }
+    if (name.empty())
+        name = "-";
+    name = name.substr(0, 100);
+
+    char line[256];
+    int size = sprintf(line, "%s %s %.0f %.0f %.0f\n", version.substr(0, 16).c_str(),
+                       name.c_str(), runTimes.resolve * 1e6, runTimes.spawn * 1e6,
+                       runTimes.child * 1e6);
+
+    // the statistics must never fail the build, so errors are ignored
+#ifdef _WIN32
+    HANDLE file = CreateFile(fileName.c_str(), FILE_APPEND_DATA,
+                             FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                             OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return;
+    DWORD written = 0;
+    WriteFile(file, line, static_cast<DWORD>(size), &written, NULL);
+    CloseHandle(file);
+#else
+    int fd = open(fileName.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (fd == -1)
+        return;
+    ssize_t written = write(fd, line, size);
+    (void)written;
+    ::close(fd);
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Prints the percentiles of the times recorded in a statistics file, per
+ * toolchain version and command.
+ *
+ * @return the exit code for envvc
+ */
+static int printStats(const std::string& fileName)
+{
+    if (fileName.empty())
+        throw runtime_error("no statistics file, set ENVVC_STATS or name the file");
+
+    std::ifstream in(fileName.c_str());
+    if (!in)
+        throw runtime_error("could not open " + fileName);
+
+    static const char* const metrics[] = { "resolve", "spawn", "child" };
+    const size_t metricCount = sizeof(metrics) / sizeof(metrics[0]);
+
+    std::map<string, vector<LatencyHistogram> > histograms;
+    string line;
+    while (std::getline(in, line))
+    {
+        char version[32];
+        char command[128];
+        double times[metricCount];
+        if (sscanf(line.c_str(), "%31s %127s %lf %lf %lf", version, command,
+                   &times[0], &times[1], &times[2]) != 5)
+            continue;   // a line from a crashed writer
+
+        vector<LatencyHistogram>& entry = histograms[string(version) + " " + command];
+        entry.resize(metricCount);
+        for (size_t i = 0; i < metricCount; ++i)
+            entry[i].add(times[i]);
+    }
+
+    static const double percents[] = { 50, 90, 99, 99.9, 100 };
+    cout << std::left << std::setw(8) << "version"
+         << std::setw(16) << "command"
+         << std::setw(9) << "time"
+         << std::right << std::setw(8) << "runs"
+         << std::setw(10) << "p50"
+         << std::setw(10) << "p90"
+         << std::setw(10) << "p99"
+         << std::setw(10) << "p99.9"
+         << std::setw(10) << "max" << "  (ms)\n";
+    for (std::map<string, vector<LatencyHistogram> >::const_iterator it = histograms.begin();
+         it != histograms.end(); ++it)
+    {
+        string::size_type space = it->first.find(' ');
+        for (size_t i = 0; i < metricCount; ++i)
+        {
+            const LatencyHistogram& histogram = it->second[i];
+            cout << std::left << std::setw(8) << it->first.substr(0, space)
+                 << std::setw(16) << it->first.substr(space + 1)
+                 << std::setw(9) << metrics[i]
+                 << std::right << std::setw(8) << histogram.count()
+                 << std::fixed << std::setprecision(2);
+            for (size_t p = 0; p < sizeof(percents) / sizeof(percents[0]); ++p)
+                cout << std::setw(10) << histogram.percentile(percents[p]) / 1000;
+            cout << "\n";
+        }
+    }
+    cout << std::flush;
+
+    return 0;
+}
+
+#ifndef _WIN32
+/*----------------------------------------------------------------------------*/
+/**
+ * Writes the whole buffer, write() may write less to pipes.
+ */
+static void writeAll(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return;
+        data += written;
+        size -= written;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Runs a command and waits for it, measuring the time until it runs (the
+ * exec closes a pipe, or reports its error through it) and the time until
+ * it exits.
+ *
+ * With a log file, stdout and stderr of the command go through a pipe to
+ * our stdout and to the log (what "command 2>&1 | tee file" does, without
+ * the extra process). A plain log of a command writing into a pipe is
+ * copied with tee() and splice() on Linux, so the output doesn't pass
+ * through our memory.
+ *
+ * @param logName  the log file, or empty
+ * @param prefix   starts each line in the log file
+ * @param withTime whether the lines in the log file start with the time
+ * @param includes if not 0, the stdout of the command is passed on through
+ *                 a pipe and the headers of cl /showIncludes are collected
+ *
+ * @return the exit code of the command, or -1 with errno set if it could
+ *         not be started
+ */
+static int runTimed(char* const* args, const std::string& logName,
+                    const std::string& prefix, bool withTime,
+                    std::vector<std::string>* includes)
+{
+    const size_t chunkSize = 64 * 1024;
+
+    int log = -1;
+    if (!logName.empty())
+    {
+        log = open(logName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (log == -1)
+            throw runtime_error("could not create " + logName);
+        fcntl(log, F_SETFD, FD_CLOEXEC);
+    }
+    bool isCaptured = log != -1 || includes != 0;
+
+    int ready[2];
+    if (pipe(ready) != 0)
+    {
+        int error = errno;
+        if (log != -1)
+            ::close(log);
+        errno = error;
+        return -1;
+    }
+    fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+    fcntl(ready[1], F_SETFD, FD_CLOEXEC);
+
+    int output[2] = { -1, -1 };
+    if (isCaptured && pipe(output) != 0)
+    {
+        int error = errno;
+        ::close(ready[0]);
+        ::close(ready[1]);
+        if (log != -1)
+            ::close(log);
+        errno = error;
+        return -1;
+    }
+
+    double started = now();
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        int error = errno;
+        ::close(ready[0]);
+        ::close(ready[1]);
+        if (isCaptured)
+        {
+            ::close(output[0]);
+            ::close(output[1]);
+        }
+        if (log != -1)
+            ::close(log);
+        errno = error;
+        return -1;
+    }
+    if (pid == 0)
+    {
+        ::close(ready[0]);
+        if (isCaptured)
+        {
+            dup2(output[1], 1);
+            if (log != -1)
+                dup2(output[1], 2);
+            ::close(output[0]);
+            ::close(output[1]);
+        }
+        execvp(args[0], args);
+        int error = errno;
+        ssize_t written = write(ready[1], &error, sizeof(error));
+        (void)written;
+        _exit(127);
+    }
+
+    ::close(ready[1]);
+    int error = 0;
+    ssize_t size;
+    while ((size = read(ready[0], &error, sizeof(error))) == -1 && errno == EINTR)
+        ;
+    ::close(ready[0]);
+    runTimes.spawn = now() - started;
+
+    if (isCaptured)
+    {
+        ::close(output[1]);
+        bool annotate = log != -1 && (withTime || !prefix.empty());
+#ifdef __linux__
+        // EINVAL from tee() if our stdout is no pipe
+        bool isSpliced = log != -1 && includes == 0 && !annotate;
+#endif
+        bool atLineStart = true;
+        vector<char> buffer(chunkSize);
+        string annotated;
+        string pending;
+        for (;;)
+        {
+            ssize_t got;
+#ifdef __linux__
+            if (isSpliced)
+            {
+                got = tee(output[0], 1, chunkSize, 0);
+                if (got == 0)
+                    break;
+                if (got == -1 && errno == EINTR)
+                    continue;
+                if (got > 0)
+                {
+                    // the same bytes, now taken from the pipe
+                    ssize_t moved = 0;
+                    while (moved < got)
+                    {
+                        ssize_t spliced = splice(output[0], 0, log, 0, got - moved, 0);
+                        if (spliced == -1 && errno == EINTR)
+                            continue;
+                        if (spliced <= 0)
+                            break;
+                        moved += spliced;
+                    }
+                    if (moved == got)
+                        continue;
+                    // the log isn't spliceable: read and write the rest
+                    isSpliced = false;
+                    got -= moved;
+                    ssize_t done = 0;
+                    while (done < got)
+                    {
+                        ssize_t part = read(output[0], &buffer[0] + done, got - done);
+                        if (part == -1 && errno == EINTR)
+                            continue;
+                        if (part <= 0)
+                            break;
+                        done += part;
+                    }
+                    writeAll(log, &buffer[0], done);
+                    continue;
+                }
+                isSpliced = false;
+            }
+#endif
+            got = read(output[0], &buffer[0], chunkSize);
+            if (got == 0)
+                break;
+            if (got == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            writeAll(1, &buffer[0], got);
+            if (includes != 0)
+                findIncludes(&buffer[0], got, pending, *includes);
+            if (log == -1)
+                continue;
+            if (!annotate)
+            {
+                writeAll(log, &buffer[0], got);
+                continue;
+            }
+            annotateLines(&buffer[0], got, prefix, withTime, atLineStart, annotated);
+            writeAll(log, annotated.data(), annotated.size());
+        }
+        ::close(output[0]);
+    }
+    if (log != -1)
+        ::close(log);
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    runTimes.child = now() - started - runTimes.spawn;
+
+    if (size > 0)
+    {
+        errno = error;
+        return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+#endif
+
+/*----------------------------------------------------------------------------*/
+
+/*-----------------------------------------------------------------------------+
+|   diff functions                                                             |
++-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+static bool isSearchList(const std::string& var)
+{
+    for (size_t i = 0; i < sizeof(searchLists) / sizeof(searchLists[0]); ++i)
+    {
+        if (_stricmp(var.c_str(), searchLists[i]) == 0)
+            return true;
+    }
+    return _stricmp(var.c_str(), "WINEPATH") == 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return @a text as a literal for @a shell (single quoted, or double
+ *         quoted for use within the double quotes of cmd and sh); '%' is
+ *         doubled for cmd, the commands are meant for a batch file
+ */
+static std::string shellLiteral(const std::string& text, ShellSyntax shell,
+                                bool inDoubleQuotes)
+{
+    string result;
+    for (string::const_iterator it = text.begin(); it != text.end(); ++it)
+    {
+        if (shell == shellPowerShell && *it == '\'')
+            result += '\'';
+        else if (shell == shellSh && inDoubleQuotes && strchr("\\\"$`", *it) != 0)
+            result += '\\';
+        else if (shell == shellSh && !inDoubleQuotes && *it == '\'')
+        {
+            result += "'\\''";
+            continue;
+        }
+        else if (shell == shellCmd && *it == '%')
+            result += '%';
+        result += *it;
+    }
+    if (shell == shellCmd || inDoubleQuotes)
+        return result;
+    return "'" + result + "'";
+}
+
+/*----------------------------------------------------------------------------*/
+static void printSet(const std::string& var, const std::string& value,
+                     ShellSyntax shell)
+{
+    switch (shell)
+    {
+    case shellCmd:
+        cout << "set \"" << var << "=" << shellLiteral(value, shell) << "\"\n";
+        break;
+    case shellSh:
+        cout << "export " << var << "=" << shellLiteral(value, shell) << "\n";
+        break;
+    case shellPowerShell:
+        cout << "$env:" << var << " = " << shellLiteral(value, shell) << "\n";
+        break;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static void printUnset(const std::string& var, ShellSyntax shell)
+{
+    switch (shell)
+    {
+    case shellCmd:
+        cout << "set \"" << var << "=\"\n";
+        break;
+    case shellSh:
+        cout << "unset " << var << "\n";
+        break;
+    case shellPowerShell:
+        cout << "Remove-Item Env:" << var << " -ErrorAction SilentlyContinue\n";
+        break;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Prints the commands replacing the entries a toolchain put in front of a
+ * search list with those of another toolchain. Entries both have at their
+ * end stay untouched.
+ *
+ * @param var  the search list
+ * @param from the entries of the current toolchain (maybe none)
+ * @param to   the entries of the new toolchain (maybe none)
+ */
+static void printListEdit(const std::string& var, const std::string& from,
+                          const std::string& to, ShellSyntax shell)
+{
+    const string sep(1, listSeparator(var));
+    vector<string> oldDirs = splitList(from, sep[0]);
+    vector<string> newDirs = splitList(to, sep[0]);
+    size_t common = 0;
+    while (common < oldDirs.size() && common < newDirs.size()
+           && _stricmp(oldDirs[oldDirs.size() - 1 - common].c_str(),
+                       newDirs[newDirs.size() - 1 - common].c_str()) == 0)
+        ++common;
+    if (common == oldDirs.size() && common == newDirs.size())
+        return;
+
+    // with common entries, the changed part is always followed by a separator
+    string oldPart;
+    for (size_t i = 0; i < oldDirs.size() - common; ++i)
+        oldPart += oldDirs[i] + (i + 1 < oldDirs.size() ? sep : "");
+    string newPart;
+    for (size_t i = 0; i < newDirs.size() - common; ++i)
+        newPart += newDirs[i] + (i + 1 < newDirs.size() ? sep : "");
+    bool isWhole = common == 0;
+
+    string oldText = shellLiteral(oldPart, shell, true);
+    string newText = shellLiteral(newPart, shell, true);
+    switch (shell)
+    {
+    case shellCmd:
+        if (oldPart.empty())
+            cout << "set \"" << var << "=" << newText << (isWhole ? sep : "")
+                 << "%" << var << "%\"\n";
+        else
+        {
+            cout << "set \"" << var << "=%" << var << ":" << oldText << "=" << newText << "%\"\n";
+            if (newPart.empty() && isWhole)
+                cout << "if \"%" << var << ":~0,1%\"==\"" << sep << "\" set \"" << var << "=%" << var << ":~1%\"\n";
+        }
+        break;
+
+    case shellSh:
+        if (oldPart.empty())
+            cout << "export " << var << "=\"" << newText
+                 << (isWhole ? "${" + var + ":+" + sep + "$" + var + "}" : "${" + var + "}") << "\"\n";
+        else
+        {
+            cout << "export " << var << "=\"" << newText << "${" << var << "#\"" << oldText << "\"}\"\n";
+            if (newPart.empty() && isWhole)
+                cout << var << "=\"${" << var << "#" << sep << "}\"; [ -n \"$" << var << "\" ] || unset " << var << "\n";
+        }
+        break;
+
+    case shellPowerShell:
+        oldText = shellLiteral(oldPart, shell);
+        newText = shellLiteral(newPart, shell);
+        if (oldPart.empty())
+            cout << "$env:" << var << " = " << newText << " + "
+                 << (isWhole ? "$(if ($env:" + var + ") { '" + sep + "' + $env:" + var + " })" : "$env:" + var)
+                 << "\n";
+        else
+            cout << "$env:" << var << " = $env:" << var << ".Replace(" << oldText << ", "
+                 << newText << ")" << (newPart.empty() && isWhole ? ".TrimStart('" + sep + "')" : "")
+                 << "\n";
+        break;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Prints the commands that change a session from one toolchain to another:
+ * the variables that differ are set or unset, the search lists are edited
+ * in place so that other entries survive.
+ *
+ * @param from the toolchain entries (without the inherited lists) the
+ *             session has now, empty if it has none
+ * @param to   the toolchain entries it shall have
+ */
+static void printDiff(const Environment& from, const Environment& to,
+                      ShellSyntax shell)
+{
+    const vector<string>& toEntries = to.entries();
+    for (vector<string>::const_iterator it = toEntries.begin(); it != toEntries.end(); ++it)
+    {
+        string::size_type equal = it->find('=');
+        string var = it->substr(0, equal);
+        string value = it->substr(equal + 1);
+        if (isSearchList(var))
+            printListEdit(var, from.get(var), value, shell);
+        else if (from.get(var) != value)
+            printSet(var, value, shell);
+    }
+
+    const vector<string>& fromEntries = from.entries();
+    for (vector<string>::const_iterator it = fromEntries.begin(); it != fromEntries.end(); ++it)
+    {
+        string var = it->substr(0, it->find('='));
+        if (!to.get(var).empty())
+            continue;
+        if (isSearchList(var))
+            printListEdit(var, from.get(var), string(), shell);
+        else
+            printUnset(var, shell);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return @a dir for comparing the entries of search lists: lower case,
+ *         without trailing (back)slashes (vcvars*.bat adds some)
+ */
+static std::string listEntryKey(const std::string& dir)
+{
+    string key(dir);
+    while (key.size() > 1 && (key[key.size() - 1] == '\\' || key[key.size() - 1] == '/'))
+        key.erase(key.size() - 1);
+    for (string::iterator it = key.begin(); it != key.end(); ++it)
+        *it = static_cast<char>(tolower(static_cast<unsigned char>(*it)));
+    return key;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Collects the toolchain entries the session has now, for 'diff' without
+ * a first version: the current values of the variables the installed
+ * toolchains set, and of the search lists only the entries at the front
+ * that one of them puts there. It doesn't matter which toolchain set up
+ * the session, or whether envvc or vcvars*.bat did it.
+ *
+ * @return the entries, empty if the session has no toolchain
+ */
+static Environment currentToolchain(bool useFX,
+                                    const std::vector<const TargetArch*>& archs)
+{
+    // by upper case name: the name, and the entries of a search list
+    std::map<string, string> names;
+    std::map<string, std::set<string> > listEntries;
+    for (size_t i = 0; i < sizeof(toolchainVersions) / sizeof(toolchainVersions[0]); ++i)
+    {
+        vector<Environment> envs;
+        try {
+            resolveToolchain(toolchainVersions[i], useFX, archs, envs);
+        }
+        catch (runtime_error&)
+        {
+            // not installed, or not for this architecture
+            continue;
+        }
+        Environment& env = envs.front();
+        if (!winePrefix.empty())
+            translateForWine(env, winePrefix);
+
+        const vector<string>& entries = env.entries();
+        for (vector<string>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+        {
+            string::size_type equal = it->find('=');
+            string var = it->substr(0, equal);
+            string upper(var);
+            std::transform(upper.begin(), upper.end(), upper.begin(), toupper);
+            names[upper] = var;
+            if (!isSearchList(var))
+                continue;
+            vector<string> dirs = splitList(it->substr(equal + 1), listSeparator(var));
+            for (vector<string>::const_iterator dir = dirs.begin(); dir != dirs.end(); ++dir)
+                listEntries[upper].insert(listEntryKey(*dir));
+        }
+    }
+
+    Environment current(archs.front()->name);
+    for (std::map<string, string>::const_iterator it = names.begin(); it != names.end(); ++it)
+    {
+        const string& var = it->second;
+        string value = getEnv(var);
+        if (value.empty() || !isSearchList(var))
+        {
+            if (!value.empty())
+                current.set(var, value);
+            continue;
+        }
+
+        // the entries are taken as they are, the shell edits them literally
+        const std::set<string>& known = listEntries[it->first];
+        char separator = listSeparator(var);
+        string::size_type front = 0;
+        while (front < value.size())
+        {
+            string::size_type end = value.find(separator, front);
+            if (end == string::npos)
+                end = value.size();
+            if (end == front || known.count(listEntryKey(value.substr(front, end - front))) == 0)
+                break;
+            front = end + 1;
+        }
+        if (front > 0)
+            current.set(var, value.substr(0, (std::min)(front - 1, value.size())));
+    }
+    return current;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*-----------------------------------------------------------------------------+
+|   prewarm functions                                                          |
++-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the file with the headers learned for a toolchain
+ */
+static std::string prewarmListFile(const std::string& version,
+                                   const Environment& env)
+{
+    return cacheFile("envvc-prewarm-" + version + "-" + env.arch());
+}
+
+/*----------------------------------------------------------------------------*/
+static bool fileExists(const std::string& fileName)
+{
+#ifdef _WIN32
+    return GetFileAttributes(fileName.c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+    return access(fileName.c_str(), F_OK) == 0;
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the files the first compile of a toolchain reads: the compiler
+ *         and linker binaries found in its PATH, and the headers most
+ *         often included by earlier runs
+ */
+static std::vector<std::string> prewarmList(const Environment& env,
+                                            const std::string& version,
+                                            const std::string& listFile)
+{
+    vector<const char*> tools;
+    tools.push_back("cl.exe");
+    tools.push_back("c1.dll");
+    tools.push_back("c1xx.dll");
+    tools.push_back("c2.dll");
+    tools.push_back("link.exe");
+    for (size_t i = 0; i < sizeof(pdbFiles) / sizeof(pdbFiles[0]); ++i)
+    {
+        if (version == pdbFiles[i].version)
+        {
+            tools.push_back(pdbFiles[i].dll);
+            if (pdbFiles[i].server)
+                tools.push_back(pdbFiles[i].server);
+        }
+    }
+#ifdef _WIN32
+    const char* const slash = "\\";
+#else
+    // the Unix form in the Wine mode
+    const char* const slash = winePrefix.empty() ? "\\" : "/";
+#endif
+
+    vector<string> files;
+    vector<string> dirs = splitList(env.get("PATH"), listSeparator("PATH"));
+    for (size_t i = 0; i < tools.size(); ++i)
+    {
+        for (vector<string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it)
+        {
+            string file = *it + slash + tools[i];
+            if (fileExists(file))
+            {
+                files.push_back(file);
+                break;
+            }
+        }
+    }
+
+    // "<count> <file>" lines, the most frequent first
+    std::ifstream in(listFile.c_str());
+    string line;
+    for (size_t count = 0; count < maxPrewarmHeaders && std::getline(in, line); ++count)
+    {
+        string::size_type space = line.find(' ');
+        if (space == string::npos)
+            continue;
+        string file = line.substr(space + 1);
+#ifndef _WIN32
+        if (!winePrefix.empty())
+            file = unixPath(winePrefix, file);
+#endif
+        if (!file.empty())
+            files.push_back(file);
+    }
+    return files;
+}
+
+#ifdef _WIN32
+/*----------------------------------------------------------------------------*/
+/**
+ * Reads the files of the list passed (and owned) into the file cache:
+ * with PrefetchVirtualMemory where available, otherwise by reading them.
+ */
+static unsigned __stdcall prewarmThread(void* fileList)
+{
+    vector<string>* files = static_cast<vector<string>*>(fileList);
+    PrefetchVirtualMemoryFunc prefetch = reinterpret_cast<PrefetchVirtualMemoryFunc>(
+        GetProcAddress(GetModuleHandle("kernel32.dll"), "PrefetchVirtualMemory"));
+
+    vector<char> buffer;
+    for (vector<string>::const_iterator it = files->begin(); it != files->end(); ++it)
+    {
+        HANDLE file = CreateFile(it->c_str(), GENERIC_READ,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                 NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            continue;
+
+        bool isQueued = false;
+        DWORD size = GetFileSize(file, NULL);
+        if (prefetch != 0 && size != INVALID_FILE_SIZE && size > 0)
+        {
+            HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : 0;
+            if (view != 0)
+            {
+                // the view stays until envvc exits, so the reads can finish
+                PrefetchRange range = { view, size };
+                isQueued = prefetch(GetCurrentProcess(), 1, &range, 0) != 0;
+            }
+            if (mapping)
+                CloseHandle(mapping);
+        }
+        if (!isQueued)
+        {
+            buffer.resize(1024 * 1024);
+            DWORD got = 0;
+            while (ReadFile(file, &buffer[0], static_cast<DWORD>(buffer.size()), &got, NULL)
+                   && got > 0)
+                ;
+        }
+        CloseHandle(file);
+    }
+    delete files;
+    return 0;
+}
+#endif
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Starts reading files into the file cache without waiting for it, so the
+ * reads overlap with the start of the command.
+ */
+static void prewarm(const std::vector<std::string>& files)
+{
+#ifdef _WIN32
+    vector<string>* fileList = new vector<string>(files);
+    HANDLE thread = reinterpret_cast<HANDLE>(
+        _beginthreadex(NULL, 0, prewarmThread, fileList, 0, NULL));
+    if (thread != 0)
+    {
+        SetThreadPriority(thread, THREAD_PRIORITY_BELOW_NORMAL);
+        CloseHandle(thread);
+    }
+    else
+        delete fileList;
+#else
+    // the kernel reads ahead in the background
+    for (vector<string>::const_iterator it = files.begin(); it != files.end(); ++it)
+    {
+        int fd = open(it->c_str(), O_RDONLY);
+        if (fd == -1)
+            continue;
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+        ::close(fd);
+    }
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Collects the headers from the "Note: including file:" lines of cl
+ * /showIncludes in the output of the command.
+ *
+ * @param pending  the incomplete last line of the previous call
+ * @param includes receives the header names
+ */
+static void findIncludes(const char* data, size_t size, std::string& pending,
+                         std::vector<std::string>& includes)
+{
+    static const char note[] = "Note: including file:";
+    const size_t noteLen = sizeof(note) - 1;
+
+    pending.append(data, size);
+    string::size_type start = 0;
+    string::size_type eol;
+    while ((eol = pending.find('\n', start)) != string::npos)
+    {
+        if (pending.compare(start, noteLen, note) == 0)
+        {
+            string::size_type begin = pending.find_first_not_of(' ', start + noteLen);
+            string::size_type end = eol;
+            if (end > start && pending[end - 1] == '\r')
+                --end;
+            if (begin < end)
+                includes.push_back(pending.substr(begin, end - begin));
+        }
+        start = eol + 1;
+    }
+    pending.erase(0, start);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Counts the headers a run included in the list of the toolchain. The
+ * list keeps the most frequent ones and is replaced at once, so concurrent
+ * runs read a complete list (and at worst lose a count).
+ */
+static void learnIncludes(const std::string& listFile,
+                          const std::vector<std::string>& includes)
+{
+    if (includes.empty() || listFile.empty())
+        return;
+
+    // by the upper case name, as cl doesn't keep the case
+    std::map<string, std::pair<unsigned long, string> > counts;
+    std::ifstream in(listFile.c_str());
+    string line;
+    while (std::getline(in, line))
+    {
+        string::size_type space = line.find(' ');
+        if (space == string::npos)
+            continue;
+        string file = line.substr(space + 1);
+        string key(file);
+        std::transform(key.begin(), key.end(), key.begin(), toupper);
+        counts[key] = std::make_pair(strtoul(line.c_str(), 0, 10), file);
+    }
+    in.close();
+
+    vector<string> keys;
+    for (vector<string>::const_iterator it = includes.begin(); it != includes.end(); ++it)
+    {
+        string key(*it);
+        std::transform(key.begin(), key.end(), key.begin(), toupper);
+        keys.push_back(key);
+        counts[key].second = *it;
+    }
+    // a header counts once per run
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    for (vector<string>::const_iterator it = keys.begin(); it != keys.end(); ++it)
+        ++counts[*it].first;
+
+    vector<std::pair<unsigned long, string> > sorted;
+    for (std::map<string, std::pair<unsigned long, string> >::const_iterator it = counts.begin();
+         it != counts.end(); ++it)
+        sorted.push_back(std::make_pair(~0ul - it->second.first, it->second.second));
+    std::sort(sorted.begin(), sorted.end());
+    if (sorted.size() > maxLearnedHeaders)
+        sorted.resize(maxLearnedHeaders);
+
+    char pid[32];
+#ifdef _WIN32
+    sprintf(pid, ".%lu", static_cast<unsigned long>(GetCurrentProcessId()));
+#else
+    sprintf(pid, ".%lu", static_cast<unsigned long>(getpid()));
+#endif
+    string tempName = listFile + pid;
+    {
+        std::ofstream out(tempName.c_str());
+        for (size_t i = 0; i < sorted.size(); ++i)
+            out << ~0ul - sorted[i].first << ' ' << sorted[i].second << '\n';
+        if (!out)
+        {
+            remove(tempName.c_str());
+            return;
+        }
+    }
+#ifdef _WIN32
+    if (!MoveFileEx(tempName.c_str(), listFile.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+    if (rename(tempName.c_str(), listFile.c_str()) != 0)
+#endif
+        remove(tempName.c_str());
+}
+
+/*----------------------------------------------------------------------------*/
+
+#ifdef _WIN32
+/*-----------------------------------------------------------------------------+
+|   process functions                                                          |
++-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Joins an argument vector into a command line that the C runtime of the
+ * child splits back into the same arguments.
+ */
+static std::string commandLine(char* const* args)
+{
+    string result;
+    for (char* const* arg = args; *arg != 0; ++arg)
+    {
+        if (arg != args)
+            result += ' ';
+
+        string value(*arg);
+        if (!value.empty() && value.find_first_of(" \t\"") == string::npos)
+        {
+            result += value;
+            continue;
+        }
+
+        // backslashes are only special in front of a quote
+        result += '"';
+        string::size_type backslashes = 0;
+        for (string::const_iterator it = value.begin(); it != value.end(); ++it)
+        {
+            if (*it == '\\')
+                ++backslashes;
+            else
+            {
+                if (*it == '"')
+                    result.append(backslashes + 1, '\\');
+                backslashes = 0;
+            }
+            result += *it;
+        }
+        result.append(backslashes, '\\');
+        result += '"';
+    }
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Builds a complete environment block for CreateProcess: the environment
+ * of this process (unless @a env is complete) with the variables of @a env
+ * (and @a extra, "VAR=value" entries) replacing or adding to it. The block is sorted by name, as
+ * Windows expects.
+ */
+static std::vector<char> environmentBlock(const Environment& env,
+                                          const std::vector<std::string>& extra)
+{
+    // the key is the upper case name; names of the hidden "=C:" style
+    // variables start with '='
+    std::map<string, string> vars;
+
+    char* strings = GetEnvironmentStrings();
+    for (const char* entry = strings; *entry != '\0'; entry += strlen(entry) + 1)
+    {
+        // a complete environment only keeps the current directories
+        if (env.isComplete() && *entry != '=')
+            continue;
+        string value(entry);
+        string name = value.substr(0, value.find('=', 1));
+        std::transform(name.begin(), name.end(), name.begin(), toupper);
+        vars[name] = value;
+    }
+    FreeEnvironmentStrings(strings);
+
+    vector<string> overrides(env.entries());
+    overrides.insert(overrides.end(), extra.begin(), extra.end());
+    for (vector<string>::const_iterator it = overrides.begin(); it != overrides.end(); ++it)
+    {
+        string name = it->substr(0, it->find('='));
+        std::transform(name.begin(), name.end(), name.begin(), toupper);
+        vars[name] = *it;
+    }
+
+    vector<char> block;
+    for (std::map<string, string>::const_iterator it = vars.begin(); it != vars.end(); ++it)
+    {
+        block.insert(block.end(), it->second.begin(), it->second.end());
+        block.push_back('\0');
+    }
+    block.push_back('\0');
+    return block;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Looks up a program in the PATH of the given environment (not in our
+ * own, the toolchain directories are only in the child's PATH).
+ *
+ * @return the full path, or @a program itself if it wasn't found
+ */
+static std::string findProgram(const std::string& program,
+                               const Environment& env)
+{
+    const char* const extensions[] = { ".exe", ".com", ".bat", ".cmd" };
+    string path = env.get("PATH");
+
+    char buffer[MAX_PATH];
+    for (size_t i = 0; i < sizeof(extensions)/sizeof(extensions[0]); ++i)
+    {
+        DWORD len = SearchPath(path.c_str(), program.c_str(), extensions[i],
+                               MAX_PATH, buffer, NULL);
+        if (len > 0 && len < MAX_PATH)
+            return string(buffer, len);
+    }
+    return program;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Starts a command with its own environment block.
+ *
+ * @param args     NULL terminated argument vector
+ * @param env      the toolchain environment, used to find the program
+ * @param envBlock the complete environment of the child
+ * @param output   handle for stdout and stderr of the child, 0 to inherit
+ *
+ * @return the process information; the caller closes the handles
+ */
+static PROCESS_INFORMATION startProcess(char* const* args,
+                                        const Environment& env,
+                                        std::vector<char>& envBlock,
+                                        HANDLE output)
+{
+    string program = findProgram(args[0], env);
+    string cmdLine = commandLine(args);
+
+    // batch files need the command interpreter
+    string ext = program.size() > 4 ? program.substr(program.size() - 4) : "";
+    if (_stricmp(ext.c_str(), ".bat") == 0 || _stricmp(ext.c_str(), ".cmd") == 0)
+    {
+        char* batch[] = { &program[0], 0 };
+        string rest = commandLine(args + 1);
+        cmdLine = "/c \"" + commandLine(batch)
+                + (rest.empty() ? "" : " " + rest) + "\"";
+        program = getEnv("ComSpec");
+        cmdLine = "\"" + program + "\" " + cmdLine;
+    }
+
+    STARTUPINFO startup;
+    memset(&startup, 0, sizeof(startup));
+    startup.cb = sizeof(startup);
+    if (output)
+    {
+        startup.dwFlags = STARTF_USESTDHANDLES;
+        startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+        startup.hStdOutput = output;
+        startup.hStdError = output;
+    }
+
+    // the output handle is only inheritable while this child is created,
+    // so children running at the same time don't hold each other's logs
+    if (output)
+        SetHandleInformation(output, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+    PROCESS_INFORMATION process;
+    vector<char> cmdBuffer(cmdLine.begin(), cmdLine.end());
+    cmdBuffer.push_back('\0');
+    BOOL isStarted = CreateProcess(program.c_str(), &cmdBuffer[0], NULL, NULL, TRUE, 0,
+                                   &envBlock[0], NULL, &startup, &process);
+    if (output)
+        SetHandleInformation(output, HANDLE_FLAG_INHERIT, 0);
+    if (!isStarted)
+        throw runtime_error("failed to execute " + string(args[0]));
+    return process;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Writes the whole buffer, WriteFile may write less to pipes.
+ */
+static void writeAll(HANDLE handle, const char* data, DWORD size)
+{
+    while (size > 0)
+    {
+        DWORD written = 0;
+        if (!WriteFile(handle, data, size, &written, NULL) || written == 0)
+            return;
+        data += written;
+        size -= written;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Runs a command and copies everything it writes to stdout and stderr both
+ * to our console and to a log file (what "command 2>&1 | tee file" does,
+ * without the extra process and its copying).
+ *
+ * The child writes into a large pipe and we read big chunks, so even very
+ * chatty tools rarely wait for us. Each chunk goes unchanged to the
+ * console; in the log file every line can be annotated with @a prefix
+ * and a time stamp.
+ *
+ * @return the exit code of the command
+ */
+static int runLogged(char* const* args, const Environment& env,
+                     const std::string& logName,
+                     const std::string& prefix, bool withTime,
+                     std::vector<std::string>* includes)
+{
+    const DWORD chunkSize = 64 * 1024;
+
+    HANDLE log = CreateFile(logName.c_str(), GENERIC_WRITE, FILE_SHARE_READ,
+                            NULL, CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (log == INVALID_HANDLE_VALUE)
+        throw runtime_error("could not create " + logName);
+
+    SECURITY_ATTRIBUTES inherit = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+    HANDLE readEnd = 0;
+    HANDLE writeEnd = 0;
+    if (!CreatePipe(&readEnd, &writeEnd, &inherit, 4 * chunkSize))
+    {
+        CloseHandle(log);
+        throw runtime_error("could not create the output pipe");
+    }
+    // the child must only inherit the write end
+    SetHandleInformation(readEnd, HANDLE_FLAG_INHERIT, 0);
+
+    vector<char> envBlock = environmentBlock(env, vector<string>());
+    PROCESS_INFORMATION process;
+    double spawned = now();
+    try {
+        process = startProcess(args, env, envBlock, writeEnd);
+    }
+    catch (...)
+    {
+        CloseHandle(readEnd);
+        CloseHandle(writeEnd);
+        CloseHandle(log);
+        throw;
+    }
+    CloseHandle(process.hThread);
+    runTimes.spawn = now() - spawned;
+    // otherwise ReadFile wouldn't see the end when the child exits
+    CloseHandle(writeEnd);
+
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    bool annotate = withTime || !prefix.empty();
+    bool atLineStart = true;
+    vector<char> chunk(chunkSize);
+    string annotated;
+    string pending;
+    DWORD size = 0;
+    while (ReadFile(readEnd, &chunk[0], chunkSize, &size, NULL) && size > 0)
+    {
+        writeAll(console, &chunk[0], size);
+        if (includes)
+            findIncludes(&chunk[0], size, pending, *includes);
+        if (!annotate)
+        {
+            writeAll(log, &chunk[0], size);
+            continue;
+        }
+
+        annotateLines(&chunk[0], size, prefix, withTime, atLineStart, annotated);
+        writeAll(log, annotated.data(), static_cast<DWORD>(annotated.size()));
+    }
+
+    WaitForSingleObject(process.hProcess, INFINITE);
+    runTimes.child = now() - spawned - runTimes.spawn;
+    DWORD exitCode = 1;
+    GetExitCodeProcess(process.hProcess, &exitCode);
+    CloseHandle(process.hProcess);
+    CloseHandle(readEnd);
+    CloseHandle(log);
+
+    return static_cast<int>(exitCode);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Runs the same command under several toolchains, at most @a maxJobs at
+ * a time. Each run gets its own directory below @a outDir (passed to the
+ * command as ENVVC_OUTDIR) with the captured output in output.log.
+ *
+ * @return 0 if the command succeeded for all toolchains
+ */
+static int runMatrix(const std::vector<std::string>& versions,
+                     bool useFX, bool isForced,
+                     const std::vector<const TargetArch*>& archs,
+                     unsigned maxJobs, const std::string& outDir,
+                     char* const* args)
+{
+    if (archs.size() != 1)
+        throw runtime_error("the matrix mode needs exactly one architecture");
+
+    CreateDirectory(outDir.c_str(), NULL);
+
+    // resolve all toolchains before starting anything
+    vector<MatrixRun> runs;
+    vector<Environment> envs;
+    for (vector<string>::const_iterator it = versions.begin(); it != versions.end(); ++it)
+    {
+        if (!isKnownVersion(*it))
+            throw runtime_error("unknown version " + *it);
+
+        MatrixRun run = { *it, "", "", 0, 0, 0, 0 };
+        compiler.clear();
+        try {
+            vector<Environment> resolved;
+            bool isCurrent = resolveToolchain(*it, useFX, archs, resolved);
+            envs.push_back(resolved.front());
+            if (isHermetic)
+                makeHermetic(envs.back());
+            if (!isForced && !isCurrent)
+                run.status = "old SP";
+        }
+        catch (runtime_error& e)
+        {
+            envs.push_back(Environment(archs.front()->name));
+            run.status = "not found";
+            cerr << "vc" << *it << ": " << e.what() << "\n";
+        }
+        run.compiler = compiler;
+        runs.push_back(run);
+    }
+
+    vector<HANDLE> running;
+    vector<size_t> runningIndex;
+    size_t next = 0;
+    while (next < runs.size() || !running.empty())
+    {
+        // start as many as allowed
+        while (next < runs.size() && running.size() < maxJobs)
+        {
+            MatrixRun& run = runs[next];
+            if (!run.status.empty())
+            {
+                ++next;
+                continue;
+            }
+
+            string runDir = outDir + "\\vc" + run.version;
+            CreateDirectory(runDir.c_str(), NULL);
+            string logName = runDir + "\\output.log";
+            PROCESS_INFORMATION process;
+            try {
+                // startProcess makes it inheritable for this child only
+                run.log = CreateFile(logName.c_str(), GENERIC_WRITE, FILE_SHARE_READ,
+                                     NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+                if (run.log == INVALID_HANDLE_VALUE)
+                    throw runtime_error("could not create " + logName);
+
+                vector<string> extra(1, "ENVVC_OUTDIR=" + runDir);
+                vector<char> envBlock = environmentBlock(envs[next], extra);
+                run.ticks = GetTickCount();
+                process = startProcess(args, envs[next], envBlock, run.log);
+            }
+            catch (runtime_error& e)
+            {
+                // the others keep running, the summary shows this one
+                if (run.log != INVALID_HANDLE_VALUE)
+                    CloseHandle(run.log);
+                run.log = 0;
+                run.status = "start failed";
+                run.exitCode = static_cast<DWORD>(-1);
+                cerr << "vc" << run.version << ": " << e.what() << "\n";
+                ++next;
+                continue;
+            }
+            CloseHandle(process.hThread);
+            run.process = process.hProcess;
+            running.push_back(run.process);
+            runningIndex.push_back(next);
+            cout << "started " << run.compiler << " (" << logName << ")" << endl;
+            ++next;
+        }
+
+        if (running.empty())
+            continue;
+
+        DWORD result = WaitForMultipleObjects(static_cast<DWORD>(running.size()),
+                                              &running[0], FALSE, INFINITE);
+        if (result - WAIT_OBJECT_0 >= running.size())
+            throw runtime_error("waiting for the children failed");
+
+        size_t done = result - WAIT_OBJECT_0;
+        MatrixRun& run = runs[runningIndex[done]];
+        run.ticks = GetTickCount() - run.ticks;
+        GetExitCodeProcess(run.process, &run.exitCode);
+        run.status = run.exitCode == 0 ? "ok" : "failed";
+        CloseHandle(run.process);
+        CloseHandle(run.log);
+        running.erase(running.begin() + done);
+        runningIndex.erase(runningIndex.begin() + done);
+    }
+
+    // summary table
+    int retval = 0;
+    cout << "\n"
+         << std::left << std::setw(8) << "version"
+         << std::setw(44) << "compiler"
+         << std::setw(12) << "status"
+         << std::right << std::setw(6) << "exit"
+         << std::setw(10) << "seconds" << "\n";
+    for (vector<MatrixRun>::const_iterator it = runs.begin(); it != runs.end(); ++it)
+    {
+        bool hasRun = it->status == "ok" || it->status == "failed";
+        if (it->status != "ok")
+            retval = 1;
+        cout << std::left << std::setw(8) << it->version
+             << std::setw(44) << it->compiler
+             << std::setw(12) << it->status
+             << std::right << std::setw(6);
+        if (hasRun)
+        {
+            cout << it->exitCode << std::setw(10) << std::fixed
+                 << std::setprecision(1) << it->ticks / 1000.0;
+        }
+        else if (it->status == "start failed")
+            cout << static_cast<int>(it->exitCode) << std::setw(10) << "-";
+        else
+            cout << "-" << std::setw(10) << "-";
+        cout << "\n";
+    }
+    cout << endl;
+
+    return retval;
+}
+
+/*----------------------------------------------------------------------------*/
+
+#endif
+
+/*-----------------------------------------------------------------------------+
+|   benchmark functions                                                        |
++-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+static void makeDirectory(const std::string& dir)
+{
+#ifdef _WIN32
+    CreateDirectory(dir.c_str(), NULL);
+#else
+    mkdir(dir.c_str(), 0777);
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Runs a compile with the output of cl in @a logName.
+ *
+ * @return the seconds it took, or a negative value if it failed
+ */
+static double compileOnce(const Environment& env,
+                          const std::vector<std::string>& command,
+                          const std::string& logName)
+{
+    vector<string> words(command);
+    vector<char*> args;
+    for (vector<string>::iterator it = words.begin(); it != words.end(); ++it)
+        args.push_back(&(*it)[0]);
+    args.push_back(0);
+
+#ifdef _WIN32
+    HANDLE log = CreateFile(logName.c_str(), GENERIC_WRITE, FILE_SHARE_READ,
+                            NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (log == INVALID_HANDLE_VALUE)
+        throw runtime_error("could not create " + logName);
+
+    vector<char> envBlock = environmentBlock(env, vector<string>());
+    double started = now();
+    PROCESS_INFORMATION process;
+    try {
+        process = startProcess(&args[0], env, envBlock, log);
+    }
+    catch (...)
+    {
+        CloseHandle(log);
+        throw;
+    }
+    WaitForSingleObject(process.hProcess, INFINITE);
+    double seconds = now() - started;
+
+    DWORD exitCode = 1;
+    GetExitCodeProcess(process.hProcess, &exitCode);
+    CloseHandle(process.hThread);
+    CloseHandle(process.hProcess);
+    CloseHandle(log);
+    return exitCode == 0 ? seconds : -1;
+#else
+    int log = open(logName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (log == -1)
+        throw runtime_error("could not create " + logName);
+
+    double started = now();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(log, 1);
+        dup2(log, 2);
+        try {
+            env.apply();
+            execvp(args[0], &args[0]);
+        }
+        catch (...)
+        {
+        }
+        _exit(127);
+    }
+    ::close(log);
+    if (pid == -1)
+        throw runtime_error("could not start " + command.front());
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    double seconds = now() - started;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? seconds : -1;
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+static std::string jsonString(const std::string& text)
+{
+    string result("\"");
+    for (string::const_iterator it = text.begin(); it != text.end(); ++it)
+    {
+        if (*it == '"' || *it == '\\')
+            result += '\\';
+        result += *it;
+    }
+    return result + "\"";
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Compiles the bundled benchmark cases under each toolchain: one warmup
+ * compile and @a runs timed ones per case. The sources, objects and cl
+ * output go to envvc-bench in the current directory.
+ *
+ * @param versions the versions to compare (checked by the caller), all
+ *                 if empty
+ *
+ * @return 0 if all compiles succeeded
+ */
+static int runBench(const std::vector<std::string>& versions,
+                    bool useFX, bool isForced,
+                    const std::vector<const TargetArch*>& archs,
+                    unsigned runs, bool asJson)
+{
+    if (archs.size() != 1)
+        throw runtime_error("the benchmark needs exactly one architecture");
+#ifdef _WIN32
+    const char* const slash = "\\";
+#else
+    if (winePrefix.empty())
+        throw runtime_error("the benchmark needs Windows or --wine");
+    const char* const slash = "/";
+#endif
+    vector<string> toRun(versions);
+    if (toRun.empty())
+    {
+        toRun.assign(toolchainVersions, toolchainVersions
+                     + sizeof(toolchainVersions) / sizeof(toolchainVersions[0]));
+    }
+
+    const string dir("envvc-bench");
+    makeDirectory(dir);
+    const size_t caseCount = sizeof(benchCases) / sizeof(benchCases[0]);
+    for (size_t i = 0; i < caseCount; ++i)
+    {
+        string fileName = dir + slash + benchCases[i].name + ".cpp";
+        std::ofstream out(fileName.c_str());
+        out << benchCases[i].source;
+        if (!out)
+            throw runtime_error("could not write " + fileName);
+    }
+
+#ifndef _WIN32
+    DirectoryCache cache(cacheFile("envvc-dirs"));
+    directoryCache = &cache;
+#endif
+    int retval = 0;
+    vector<BenchResult> results;
+    for (vector<string>::const_iterator version = toRun.begin(); version != toRun.end(); ++version)
+    {
+        BenchResult result = { *version, "", "-", "", 0, 0 };
+        vector<Environment> envs;
+        compiler.clear();
+        try {
+            if (!resolveToolchain(*version, useFX, archs, envs) && !isForced)
+                result.status = "old SP";
+        }
+        catch (runtime_error&)
+        {
+            result.status = "not found";
+        }
+        result.compiler = compiler;
+        if (!result.status.empty())
+        {
+            // only missing toolchains that were asked for are errors
+            if (!versions.empty())
+                retval = 1;
+            results.push_back(result);
+            continue;
+        }
+
+        Environment& env = envs.front();
+        if (!winePrefix.empty())
+            translateForWine(env, winePrefix);
+        if (isHermetic)
+            makeHermetic(env);
+
+        string outDir = dir + slash + "vc" + *version;
+        makeDirectory(outDir);
+        for (size_t i = 0; i < caseCount; ++i)
+        {
+            // cl gets Windows paths, relative ones work with Wine as well
+            vector<string> command;
+#ifndef _WIN32
+            command.push_back("wine");
+#endif
+            command.push_back("cl");
+            command.push_back("/nologo");
+            command.push_back("/c");
+            command.push_back("/EHsc");
+            command.push_back("/O2");
+            command.push_back("/Fo" + dir + "\\vc" + *version + "\\");
+            command.push_back(dir + "\\" + benchCases[i].name + ".cpp");
+            string logName = outDir + slash + benchCases[i].name + ".log";
+
+            if (!asJson)
+                cerr << "vc" << *version << " " << benchCases[i].name << "..." << endl;
+            result.caseName = benchCases[i].name;
+            result.status = "ok";
+            vector<double> times;
+            for (unsigned run = 0; run <= runs; ++run)
+            {
+                double seconds = compileOnce(env, command, logName);
+                if (seconds < 0)
+                {
+                    result.status = "failed";
+                    retval = 1;
+                    break;
+                }
+                // the first one only warms up the caches
+                if (run > 0)
+                    times.push_back(seconds);
+            }
+            if (result.status == "ok")
+            {
+                std::sort(times.begin(), times.end());
+                size_t middle = times.size() / 2;
+                result.median = times.size() % 2
+                    ? times[middle] : (times[middle - 1] + times[middle]) / 2;
+                result.minimum = times.front();
+            }
+            results.push_back(result);
+        }
+    }
+#ifndef _WIN32
+    cache.save();
+    directoryCache = 0;
+#endif
+
+    if (asJson)
+    {
+        cout << "{\n  \"runs\": " << runs << ",\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const BenchResult& result = results[i];
+            cout << (i ? "," : "") << "\n    { \"version\": " << jsonString(result.version)
+                 << ", \"compiler\": " << jsonString(result.compiler)
+                 << ", \"case\": " << jsonString(result.caseName)
+                 << ", \"status\": " << jsonString(result.status);
+            if (result.status == "ok")
+            {
+                cout << std::fixed << std::setprecision(1)
+                     << ", \"medianMs\": " << result.median * 1000
+                     << ", \"minMs\": " << result.minimum * 1000
+                     << ", \"perMinute\": " << 60 / result.median;
+            }
+            cout << " }";
+        }
+        cout << "\n  ]\n}" << endl;
+        return retval;
+    }
+
+    cout << "\n"
+         << std::left << std::setw(8) << "version"
+         << std::setw(36) << "compiler"
+         << std::setw(11) << "case"
+         << std::setw(10) << "status"
+         << std::right << std::setw(11) << "median ms"
+         << std::setw(10) << "min ms"
+         << std::setw(10) << "per min" << "\n";
+    for (vector<BenchResult>::const_iterator it = results.begin(); it != results.end(); ++it)
+    {
+        cout << std::left << std::setw(8) << it->version
+             << std::setw(36) << it->compiler.substr(0, 35)
+             << std::setw(11) << it->caseName
+             << std::setw(10) << it->status
+             << std::right;
+        if (it->status == "ok")
+        {
+            cout << std::fixed << std::setprecision(1)
+                 << std::setw(11) << it->median * 1000
+                 << std::setw(10) << it->minimum * 1000
+                 << std::setw(10) << 60 / it->median;
+        }
+        else
+            cout << std::setw(11) << "-" << std::setw(10) << "-" << std::setw(10) << "-";
+        cout << "\n";
+    }
+    cout << endl;
+
+    return retval;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*-----------------------------------------------------------------------------+
+|   bake functions                                                             |
++-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return @a text as a C string literal, split into lines of about 72
+ *         characters (Visual C++ 6.0 limits a single literal to 2048)
+ */
+static std::string cLiteral(const std::string& text)
+{
+    string result("\"");
+    size_t lineSize = 0;
+    for (string::const_iterator it = text.begin(); it != text.end(); ++it)
+    {
+        if (lineSize >= 72)
+        {
+            result += "\"\n        \"";
+            lineSize = 0;
+        }
+        unsigned char c = static_cast<unsigned char>(*it);
+        if (c == '"' || c == '\\')
+        {
+            result += '\\';
+            result += *it;
+            lineSize += 2;
+        }
+        else if (c < ' ' || c > '~')
+        {
+            // always three digits, so a following digit can't extend it
+            char octal[8];
+            sprintf(octal, "\\%03o", c);
+            result += octal;
+            lineSize += 4;
+        }
+        else
+        {
+            result += *it;
+            ++lineSize;
+        }
+    }
+    return result + "\"";
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the full path of @a program in the toolchain PATH, throws if it
+ *         is not there
+ */
+static std::string findTool(const std::string& program, const Environment& env)
+{
+#ifdef _WIN32
+    string path = findProgram(program, env);
+    if (path != program)
+        return path;
+#else
+    // the Unix form of the toolchain directories in the Wine mode, the
+    // names of the files can have any case
+    string exeName = program + ".exe";
+    vector<string> dirs = splitList(env.get("PATH"), listSeparator("PATH"));
+    for (vector<string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it)
+    {
+        DIR* dir = opendir(it->c_str());
+        if (dir == 0)
+            continue;
+        string found;
+        while (struct dirent* entry = readdir(dir))
+        {
+            if (_stricmp(entry->d_name, exeName.c_str()) == 0
+                || (found.empty() && _stricmp(entry->d_name, program.c_str()) == 0))
+            {
+                found = entry->d_name;
+            }
+        }
+        closedir(dir);
+        if (!found.empty())
+            return *it + "/" + found;
+    }
+#endif
+    throw runtime_error(program + " is not in the PATH of " + compiler);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the names of the .exe and .dll files in a directory, sorted
+ */
+static std::vector<std::string> listBinaries(const std::string& dir)
+{
+    vector<string> names;
+#ifdef _WIN32
+    WIN32_FIND_DATA data;
+    HANDLE find = FindFirstFile((dir + "\\*.*").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE)
+        return names;
+    do {
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            names.push_back(data.cFileName);
+    } while (FindNextFile(find, &data));
+    FindClose(find);
+#else
+    DIR* handle = opendir(dir.c_str());
+    if (handle == 0)
+        return names;
+    while (struct dirent* entry = readdir(handle))
+        names.push_back(entry->d_name);
+    closedir(handle);
+#endif
+
+    vector<string> binaries;
+    for (vector<string>::const_iterator it = names.begin(); it != names.end(); ++it)
+    {
+        const char* ext = it->size() > 4 ? it->c_str() + it->size() - 4 : "";
+        if (_stricmp(ext, ".exe") == 0 || _stricmp(ext, ".dll") == 0)
+            binaries.push_back(*it);
+    }
+    std::sort(binaries.begin(), binaries.end());
+    return binaries;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the files and directories whose size and time make up the stamp
+ *         of a launcher: the binaries next to the tool, the program
+ *         database binaries of the version in the PATH and the directories
+ *         of INCLUDE, LIB and LIBPATH (a service pack or a changed
+ *         registry moves or touches them)
+ */
+static std::vector<std::string> stampFiles(const Environment& env,
+                                           const std::string& version,
+                                           const std::string& tool)
+{
+#ifdef _WIN32
+    const char slash = '\\';
+#else
+    // the Unix form in the Wine mode
+    const char slash = '/';
+#endif
+    vector<string> files;
+    string::size_type end = tool.find_last_of("\\/");
+    string toolDir = tool.substr(0, end);
+    vector<string> binaries = listBinaries(toolDir);
+    for (vector<string>::const_iterator it = binaries.begin(); it != binaries.end(); ++it)
+        files.push_back(toolDir + slash + *it);
+
+    vector<string> dirs = splitList(env.get("PATH"), listSeparator("PATH"));
+    for (vector<string>::const_iterator dir = dirs.begin(); dir != dirs.end(); ++dir)
+    {
+        if (*dir == toolDir)
+            continue;
+        binaries = listBinaries(*dir);
+        for (vector<string>::const_iterator it = binaries.begin(); it != binaries.end(); ++it)
+        {
+            for (size_t i = 0; i < sizeof(pdbFiles) / sizeof(pdbFiles[0]); ++i)
+            {
+                if (version == pdbFiles[i].version
+                    && (_stricmp(it->c_str(), pdbFiles[i].dll) == 0
+                        || (pdbFiles[i].server && _stricmp(it->c_str(), pdbFiles[i].server) == 0)))
+                {
+                    files.push_back(*dir + slash + *it);
+                }
+            }
+        }
+    }
+
+    const char* const lists[] = { "INCLUDE", "LIB", "LIBPATH" };
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); ++i)
+    {
+        dirs = splitList(env.get(lists[i]), ';');
+        for (vector<string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it)
+        {
+#ifdef _WIN32
+            files.push_back(*it);
+#else
+            string dir = unixPath(winePrefix, *it);
+            if (!dir.empty())
+                files.push_back(dir);
+#endif
+        }
+    }
+    return files;
+}
+
+/*----------------------------------------------------------------------------*/
+static unsigned stampWord(unsigned hash, unsigned long word)
+{
+    // the low 32 bits in little endian order, whatever the size of long
+    unsigned char bytes[4];
+    for (int i = 0; i < 4; ++i)
+        bytes[i] = static_cast<unsigned char>((word >> (8 * i)) & 0xFF);
+    return fnvHash(hash, bytes, sizeof(bytes));
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the stamp of a launcher: an FNV-1a hash of its variables and of
+ *         the size and modification time of @a files, like checkStamp()
+ *         in launcherSource computes it
+ */
+static unsigned stampHash(const std::vector<std::string>& entries,
+                          const std::vector<std::string>& files)
+{
+    unsigned hash = fnvBasis;
+    for (vector<string>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+        hash = fnvHash(hash, it->c_str(), it->size() + 1);
+    for (vector<string>::const_iterator it = files.begin(); it != files.end(); ++it)
+    {
+        // size and time, all bits set if it is missing
+        unsigned long words[4] = { 0xFFFFFFFFul, 0xFFFFFFFFul, 0xFFFFFFFFul, 0xFFFFFFFFul };
+        struct stat info;
+        if (stat(it->c_str(), &info) == 0)
+        {
+            words[0] = static_cast<unsigned long>(info.st_size) & 0xFFFFFFFFul;
+            words[1] = static_cast<unsigned long>(info.st_size >> 16 >> 16) & 0xFFFFFFFFul;
+            words[2] = static_cast<unsigned long>(info.st_mtime) & 0xFFFFFFFFul;
+            words[3] = static_cast<unsigned long>(info.st_mtime >> 16 >> 16) & 0xFFFFFFFFul;
+        }
+        for (int i = 0; i < 4; ++i)
+            hash = stampWord(hash, words[i]);
+    }
+    return hash;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the command line that bakes the launcher again, with the
+ *         arguments quoted for the shell where needed
+ */
+static std::string rebakeCommand(char* const* args)
+{
+    string result;
+    for (char* const* arg = args; *arg != 0; ++arg)
+    {
+        if (arg != args)
+            result += ' ';
+        string word(*arg);
+        if (!word.empty()
+            && word.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                                      "0123456789_-+=.,:/\\@") == string::npos)
+        {
+            result += word;
+            continue;
+        }
+#ifdef _WIN32
+        // cmd has no escape within quotes, but the quote of the C runtime
+        char* single[] = { &word[0], 0 };
+        string quoted = commandLine(single);
+        result += quoted[0] == '"' ? quoted : "\"" + quoted + "\"";
+#else
+        result += shellLiteral(word, shellSh);
+#endif
+    }
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Writes the source of a launcher: the baked data followed by
+ * launcherSource.
+ *
+ * @param tool    the full path of the tool the launcher runs
+ * @param files   the files of its stamp
+ * @param command the envvc command that bakes it, for the stamp warning
+ */
+static void writeLauncher(std::ostream& out, const Environment& env,
+                          const std::string& tool,
+                          const std::vector<std::string>& files,
+                          const std::string& command)
+{
+#ifdef _WIN32
+    string wine;
+#else
+    string wine = findWine();
+    if (wine.empty())
+        throw runtime_error("wine is not in the PATH");
+#endif
+
+    // Windows wants a complete environment block sorted by name
+    vector<string> entries(env.entries());
+    if (env.isComplete())
+    {
+        std::map<string, string> sorted;
+        for (vector<string>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+        {
+            string name = it->substr(0, it->find('='));
+            std::transform(name.begin(), name.end(), name.begin(), toupper);
+            sorted[name] = *it;
+        }
+        entries.clear();
+        for (std::map<string, string>::const_iterator it = sorted.begin(); it != sorted.end(); ++it)
+            entries.push_back(it->second);
+    }
+
+    out << "/* " << compiler << " (" << env.arch() << "), baked by envvc */\n"
+        << "#ifdef _WIN32\n"
+        << "#include <process.h>\n"
+        << "#include <signal.h>\n"
+        << "#else\n"
+        << "#define _POSIX_C_SOURCE 200112L     /* setenv */\n"
+        << "#include <unistd.h>\n"
+        << "#endif\n"
+        << "#include <sys/types.h>\n"
+        << "#include <sys/stat.h>\n"
+        << "#include <errno.h>\n"
+        << "#include <stdio.h>\n"
+        << "#include <stdlib.h>\n"
+        << "#include <string.h>\n"
+        << "\n"
+        << "static const char tool[] = " << cLiteral(tool) << ";\n"
+        << "static const char wine[] = " << cLiteral(wine) << ";\n"
+        << "static const char rebake[] = " << cLiteral(command) << ";\n"
+        << "static const int isComplete = " << (env.isComplete() ? 1 : 0) << ";\n"
+        << "\n"
+        << "/* search lists go in front of the current value, with the separator */\n"
+        << "static const struct {\n"
+        << "    const char* entry;\n"
+        << "    char separator;\n"
+        << "} vars[] = {\n";
+    for (vector<string>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        string name = it->substr(0, it->find('='));
+        char separator = '\0';
+        if (!env.isComplete() && isSearchList(name))
+            separator = listSeparator(name);
+        out << "    { " << cLiteral(*it) << ", "
+            << (separator ? string("'") + separator + "'" : string("0")) << " },\n";
+    }
+    out << "    { 0, 0 }\n"
+        << "};\n"
+        << "\n"
+        << "static const char* const stampFiles[] = {\n";
+    for (vector<string>::const_iterator it = files.begin(); it != files.end(); ++it)
+        out << "    " << cLiteral(*it) << ",\n";
+    char stamp[16];
+    sprintf(stamp, "%08x", stampHash(entries, files));
+    out << "    0\n"
+        << "};\n"
+        << "static const unsigned long stamp = 0x" << stamp << "ul;\n"
+        << launcherSource;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Bakes a launcher for a tool of a toolchain: a small program with the
+ * environment and the full path of the tool compiled in, which sets the
+ * environment and runs the tool without resolving anything. It warns when
+ * the toolchain changed since it was baked (a service pack, a new install,
+ * see stampFiles()).
+ * On Windows the toolchain compiles its own launcher; with Wine the
+ * launcher is a native program that runs the tool with wine.
+ *
+ * @param env     the resolved toolchain environment
+ * @param version the version of the toolchain
+ * @param tool    the name of the tool, like "cl" or "link"
+ * @param outName the name of the launcher
+ * @param command the envvc command line, for baking it again
+ *
+ * @return 0 on success
+ */
+static int bake(const Environment& env, const std::string& version,
+                const std::string& tool, const std::string& outName,
+                const std::string& command)
+{
+    string toolPath = findTool(tool, env);
+    string sourceName = outName + ".c";
+    string logName = outName + ".log";
+    {
+        std::ofstream out(sourceName.c_str());
+        writeLauncher(out, env, toolPath, stampFiles(env, version, toolPath), command);
+        if (!out)
+            throw runtime_error("could not write " + sourceName);
+    }
+
+    vector<string> compile;
+#ifdef _WIN32
+    string exeName = outName;
+    if (exeName.size() < 4 || _stricmp(exeName.c_str() + exeName.size() - 4, ".exe") != 0)
+        exeName += ".exe";
+    string objName = outName + ".obj";
+    compile.push_back("cl");
+    compile.push_back("/nologo");
+    compile.push_back("/O1");
+    compile.push_back("/Fe" + exeName);
+    compile.push_back("/Fo" + objName);
+    compile.push_back(sourceName);
+    const Environment& compileEnv = env;
+#else
+    const string& exeName = outName;
+    compile.push_back("cc");
+    compile.push_back("-O2");
+    compile.push_back("-o");
+    compile.push_back(exeName);
+    compile.push_back(sourceName);
+    // the native compiler with our own environment
+    const Environment compileEnv(env.arch());
+#endif
+
+    if (compileOnce(compileEnv, compile, logName) < 0)
+    {
+        cerr << "could not compile " << sourceName << ", see " << logName << endl;
+        return 1;
+    }
+    remove(sourceName.c_str());
+    remove(logName.c_str());
+#ifdef _WIN32
+    remove(objName.c_str());
+#endif
+    cout << exeName << ": " << toolPath << " (" << compiler << ", " << env.arch() << ")" << endl;
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*-----------------------------------------------------------------------------+
+|   Environment methods                                                        |
++-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+Environment::Environment(const std::string& arch)
+    : arch_(arch), isComplete_(false)
+{
+}
+
+/*----------------------------------------------------------------------------*/
+void Environment::set(const std::string& var, const std::string& value)
+{
+    string& entry = this->entry(var);
+    entry.reserve(var.size() + 1 + value.size());
+    entry.append(var).append(1, '=').append(value);
+}
+
+/*----------------------------------------------------------------------------*/
+void Environment::set(const std::string& var, const PathList& value)
+{
+    string& entry = this->entry(var);
+    entry.reserve(var.size() + 1 + value.length());
+    entry.append(var).append(1, '=');
+    value.appendTo(entry);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the (cleared) entry for @a var; a new one at the end if the
+ *         variable wasn't set before
+ */
+std::string& Environment::entry(const std::string& var)
+{
+    for (vector<string>::iterator it = entries_.begin(); it != entries_.end(); ++it)
+    {
+        if (it->size() > var.size() && (*it)[var.size()] == '='
+            && _strnicmp(it->c_str(), var.c_str(), var.size()) == 0)
+        {
+            it->clear();
+            return *it;
+        }
+    }
+    entries_.push_back(string());
+    return entries_.back();
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the value of a variable set by the toolchain, or an empty string
+ */
+std::string Environment::get(const std::string& var) const
+{
+    for (vector<string>::const_iterator it = entries_.begin(); it != entries_.end(); ++it)
+    {
+        if (it->size() > var.size() && (*it)[var.size()] == '='
+            && _strnicmp(it->c_str(), var.c_str(), var.size()) == 0)
+            return it->substr(var.size() + 1);
+    }
+    return string();
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Sets all variables in the environment of this process (and thus of the
+ * command spawned later). A complete environment replaces all variables.
+ */
+void Environment::apply() const
+{
+    if (isComplete_)
+        clearEnvironment();
+
+    for (vector<string>::const_iterator it = entries_.begin(); it != entries_.end(); ++it)
+    {
+#ifdef _WIN32
+        if (_putenv(it->c_str()) != 0)
+            throw runtime_error("_putenv failed");
+#else
+        string::size_type eq = it->find('=');
+        if (setenv(it->substr(0, eq).c_str(), it->c_str() + eq + 1, 1) != 0)
+            throw runtime_error("setenv failed");
+#endif
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the variables as "VAR=value" lines
+ */
+std::string Environment::str() const
+{
+    string::size_type size = 0;
+    for (vector<string>::const_iterator it = entries_.begin(); it != entries_.end(); ++it)
+        size += it->size() + 1;
+
+    string result;
+    result.reserve(size);
+    for (vector<string>::const_iterator it = entries_.begin(); it != entries_.end(); ++it)
+        result.append(*it).append(1, '\n');
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*-----------------------------------------------------------------------------+
+|   PathList methods                                                           |
++-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+PathList::PathList()
+{
+    // more than the doVC* functions add in front of the inherited list
+    segments_.reserve(16);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Appends the directory @a dir followed by @a suffix as one entry
+ * (e.g. add(vc8, "\\bin")). Empty entries are ignored.
+ */
+PathList& PathList::add(std::string& dir, const char* suffix)
+{
+    Segment seg = { dir.data(), dir.size(), suffix, strlen(suffix) };
+    if (seg.size() > 0)
+        segments_.push_back(seg);
+    return *this;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Appends all entries of an existing ';' separated list (typically the
+ * inherited value of the variable). Empty entries are dropped.
+ */
+PathList& PathList::addList(std::string& list)
+{
+    segments_.reserve(segments_.size() + std::count(list.begin(), list.end(), ';') + 1);
+    string::size_type start = 0;
+    while (start < list.size())
+    {
+        string::size_type end = list.find(';', start);
+        if (end == string::npos)
+            end = list.size();
+        if (end > start)
+        {
+            Segment seg = { list.data() + start, end - start, "", 0 };
+            segments_.push_back(seg);
+        }
+        start = end + 1;
+    }
+    return *this;
+}
+
+/*----------------------------------------------------------------------------*/
+std::string::size_type PathList::length() const
+{
+    string::size_type len = 0;
+    for (vector<Segment>::const_iterator it = segments_.begin(); it != segments_.end(); ++it)
+        len += it->size() + 1;
+    return len > 0 ? len - 1 : 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Writes the list to the end of @a out. The caller is expected to have
+ * reserved length() additional characters.
+ */
+void PathList::appendTo(std::string& out) const
+{
+    for (vector<Segment>::const_iterator it = segments_.begin(); it != segments_.end(); ++it)
+    {
+        if (it != segments_.begin())
+            out.append(1, ';');
+        out.append(it->head, it->headLen).append(it->tail, it->tailLen);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*-----------------------------------------------------------------------------+
+|   JobServer methods                                                          |
++-----------------------------------------------------------------------------*/
+
+#ifdef _WIN32
+/*----------------------------------------------------------------------------*/
+JobServer::JobServer()
+    : semaphore_(0), tokens_(0)
+{
+    string name = jobServerName();
+
+    // pipe file descriptors ("R,W") and fifos are not usable from a native
+    // Windows process: behave as if there was no jobserver
+    if (name.empty() || name.find(',') != string::npos
+        || name.compare(0, 5, "fifo:") == 0)
+        return;
+
+    semaphore_ = OpenSemaphore(SEMAPHORE_MODIFY_STATE | SYNCHRONIZE,
+                               FALSE, name.c_str());
+    if (semaphore_ != 0)
+    {
+        activeJobServer = this;
+        SetConsoleCtrlHandler(onConsoleCtrl, TRUE);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+JobServer::~JobServer()
+{
+    if (semaphore_)
+    {
+        release();
+        SetConsoleCtrlHandler(onConsoleCtrl, FALSE);
+        activeJobServer = 0;
+        CloseHandle(semaphore_);
+        semaphore_ = 0;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Takes up to @a wanted tokens without blocking: our own implicit token
+ * guarantees progress, so there is no point in waiting for more.
+ *
+ * @return the number of tokens acquired
+ */
+unsigned JobServer::acquire(unsigned wanted)
+{
+    unsigned acquired = 0;
+    while (semaphore_ && acquired < wanted
+           && WaitForSingleObject(semaphore_, 0) == WAIT_OBJECT_0)
+    {
+        InterlockedIncrement(&tokens_);
+        ++acquired;
+    }
+    return acquired;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Returns all acquired tokens. May be called from the console control
+ * handler thread, therefore the count is taken atomically.
+ */
+void JobServer::release()
+{
+    LONG tokens = InterlockedExchange(&tokens_, 0);
+    if (semaphore_ && tokens > 0)
+        ReleaseSemaphore(semaphore_, tokens, NULL);
+}
+
+#else
+/*----------------------------------------------------------------------------*/
+JobServer::JobServer()
+    : readFd_(-1), writeFd_(-1), count_(0)
+{
+    string name = jobServerName();
+    if (name.empty())
+        return;
+
+    if (name.compare(0, 5, "fifo:") == 0)
+    {
+        // GNU make 4.4: both ends through the named pipe
+        readFd_ = open(name.c_str() + 5, O_RDWR | O_NONBLOCK);
+        writeFd_ = readFd_;
+    }
+    else
+    {
+        // the ends of make's pipe; make closes them for jobs that aren't
+        // marked as recursive ('+')
+        int readFd = -1;
+        int writeFd = -1;
+        if (sscanf(name.c_str(), "%d,%d", &readFd, &writeFd) != 2
+            || readFd < 0 || writeFd < 0
+            || fcntl(readFd, F_GETFD) == -1 || fcntl(writeFd, F_GETFD) == -1)
+            return;
+        // a description of our own, non-blocking without changing the one
+        // make and the other jobs read from (the poll in acquire() covers
+        // systems where this shares it)
+        char path[32];
+        sprintf(path, "/dev/fd/%d", readFd);
+        readFd_ = open(path, O_RDONLY | O_NONBLOCK);
+        writeFd_ = writeFd;
+    }
+    if (readFd_ == -1)
+    {
+        writeFd_ = -1;
+        return;
+    }
+    fcntl(readFd_, F_SETFD, FD_CLOEXEC);
+
+    activeJobServer = this;
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    signal(SIGHUP, onSignal);
+}
+
+/*----------------------------------------------------------------------------*/
+JobServer::~JobServer()
+{
+    if (readFd_ != -1)
+    {
+        release();
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+        activeJobServer = 0;
+        ::close(readFd_);
+        readFd_ = writeFd_ = -1;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Takes up to @a wanted tokens without blocking: our own implicit token
+ * guarantees progress, so there is no point in waiting for more.
+ *
+ * @return the number of tokens acquired
+ */
+unsigned JobServer::acquire(unsigned wanted)
+{
+    unsigned acquired = 0;
+    while (readFd_ != -1 && acquired < wanted
+           && count_ < static_cast<sig_atomic_t>(sizeof(tokens_)))
+    {
+        struct pollfd ready = { readFd_, POLLIN, 0 };
+        char token;
+        if (poll(&ready, 1, 0) != 1 || read(readFd_, &token, 1) != 1)
+            break;
+        tokens_[count_] = token;
+        count_ = count_ + 1;
+        ++acquired;
+    }
+    return acquired;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Writes all acquired tokens back. May be called from a signal handler,
+ * therefore the count is cleared before the (async-signal-safe) write.
+ */
+void JobServer::release()
+{
+    sig_atomic_t count = count_;
+    count_ = 0;
+    for (sig_atomic_t done = 0; writeFd_ != -1 && done < count; )
+    {
+        ssize_t written = write(writeFd_, tokens_ + done, count - done);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            break;
+        done += static_cast<sig_atomic_t>(written);
+    }
+}
+#endif
+
+/*----------------------------------------------------------------------------*/
+
+/*-----------------------------------------------------------------------------+
+|   LatencyHistogram methods                                                   |
++-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+LatencyHistogram::LatencyHistogram()
+    : total_(0), max_(0)
+{
+}
+
+/*----------------------------------------------------------------------------*/
+void LatencyHistogram::add(double micros)
+{
+    if (micros < 0)
+        micros = 0;
+    unsigned long value = micros < 4e9 ? static_cast<unsigned long>(micros) : 4000000000ul;
+    size_t index = bucket(value);
+    if (index >= counts_.size())
+        counts_.resize(index + 1);
+    ++counts_[index];
+    ++total_;
+    max_ = (std::max)(max_, micros);  // windows.h defines max
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @return the highest value of the bucket the given share of the values is
+ *         below or equal to (the exact maximum for 100)
+ */
+double LatencyHistogram::percentile(double percent) const
+{
+    if (total_ == 0)
+        return 0;
+    if (percent >= 100)
+        return max_;
+
+    unsigned long rank = static_cast<unsigned long>(percent / 100 * total_ + 0.999999);
+    if (rank == 0)
+        rank = 1;
+    unsigned long seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i)
+    {
+        seen += counts_[i];
+        if (seen >= rank)
+            return (std::min)(static_cast<double>(highestValue(i)), max_);
+    }
+    return max_;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Values below 128 have a bucket each; above, the values with the same
+ * highest bit share 64 buckets.
+ */
+size_t LatencyHistogram::bucket(unsigned long value)
+{
+    if (value < 128)
+        return value;
+
+    unsigned shift = 0;
+    while ((value >> shift) >= 128)
+        ++shift;
+    return 128 + (shift - 1) * 64 + ((value >> shift) - 64);
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned long LatencyHistogram::highestValue(size_t bucket)
+{
+    if (bucket < 128)
+        return static_cast<unsigned long>(bucket);
+
+    unsigned shift = static_cast<unsigned>((bucket - 128) / 64 + 1);
+    unsigned long sub = static_cast<unsigned long>((bucket - 128) % 64 + 64);
+    return ((sub + 1) << shift) - 1;
+}
+
+/*----------------------------------------------------------------------------*/
+
+#ifndef _WIN32
+/*-----------------------------------------------------------------------------+
+|   DirectoryCache methods                                                     |
++-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @param fileName the file with the listings of earlier runs; may be empty
+ *                 or missing
+ */
+DirectoryCache::DirectoryCache(const std::string& fileName)
+    : fileName_(fileName), isChanged_(false)
+{
+    if (fileName_.empty())
+        return;
+
+    // "<mtime> <directory>" lines, each followed by the names and an empty line
+    std::ifstream in(fileName_.c_str());
+    string line;
+    while (std::getline(in, line))
+    {
+        string::size_type space = line.find(' ');
+        if (space == string::npos)
+            break;
+        Listing& entry = dirs_[line.substr(space + 1)];
+        entry.mtime = static_cast<time_t>(strtol(line.c_str(), 0, 10));
+        entry.isChecked = false;
+        entry.isStable = true;
+        while (std::getline(in, line) && !line.empty())
+            entry.names[folded(line)] = line;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Changes the case of an absolute path to the one of the existing files.
+ *
+ * @param begin the offset of the first name to change, after a '/'; the
+ *              directories in front of it are used as they are (like the
+ *              directory a Wine drive maps to)
+ *
+ * @return false if the path doesn't exist (@a path is unchanged then)
+ */
+bool DirectoryCache::canonical(std::string& path, std::string::size_type begin)
+{
+    if (path.empty() || path[0] != '/' || begin == 0 || begin > path.size()
+        || path[begin - 1] != '/')
+        return false;
+
+    string result(path);
+    while (begin < result.size())
+    {
+        string::size_type end = result.find('/', begin);
+        if (end == string::npos)
+            end = result.size();
+
+        string name = result.substr(begin, end - begin);
+        if (!name.empty() && name != "." && name != "..")
+        {
+            const Listing* entry = listing(result.substr(0, begin));
+            if (entry == 0)
+                return false;
+            std::map<string, string>::const_iterator found = entry->names.find(folded(name));
+            if (found == entry->names.end())
+                return false;
+            result.replace(begin, end - begin, found->second);
+        }
+        begin = end + 1;
+    }
+    path = result;
+    return true;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Writes the listings for the next run (replacing the file at once, so
+ * concurrent runs always read a complete file).
+ */
+void DirectoryCache::save() const
+{
+    if (!isChanged_ || fileName_.empty())
+        return;
+
+    char pid[32];
+    sprintf(pid, ".%ld", static_cast<long>(getpid()));
+    string tempName = fileName_ + pid;
+    {
+        std::ofstream out(tempName.c_str());
+        for (std::map<string, Listing>::const_iterator it = dirs_.begin();
+             it != dirs_.end(); ++it)
+        {
+            if (!it->second.isStable || it->first.find('\n') != string::npos)
+                continue;
+            out << static_cast<long>(it->second.mtime) << ' ' << it->first << '\n';
+            const std::map<string, string>& names = it->second.names;
+            for (std::map<string, string>::const_iterator name = names.begin();
+                 name != names.end(); ++name)
+            {
+                if (name->second.find('\n') == string::npos)
+                    out << name->second << '\n';
+            }
+            out << '\n';
+        }
+        if (!out)
+        {
+            unlink(tempName.c_str());
+            return;
+        }
+    }
+    if (rename(tempName.c_str(), fileName_.c_str()) != 0)
+        unlink(tempName.c_str());
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @param dir a directory with the case of the file system, ending with '/'
+ *
+ * @return the listing of @a dir, or 0 if it can't be read
+ */
+const DirectoryCache::Listing* DirectoryCache::listing(const std::string& dir)
+{
+    std::map<string, Listing>::iterator found = dirs_.find(dir);
+    if (found != dirs_.end() && found->second.isChecked)
+        return &found->second;
+
+    struct stat info;
+    if (stat(dir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode))
+        return 0;
+    if (found != dirs_.end() && found->second.mtime == info.st_mtime)
+    {
+        found->second.isChecked = true;
+        return &found->second;
+    }
+
+    DIR* handle = opendir(dir.c_str());
+    if (handle == 0)
+        return 0;
+
+    Listing& entry = dirs_[dir];
+    entry.mtime = info.st_mtime;
+    entry.isChecked = true;
+    // a change later in the same second wouldn't change the time
+    entry.isStable = info.st_mtime < time(0) - 1;
+    entry.names.clear();
+    while (struct dirent* file = readdir(handle))
+    {
+        string name(file->d_name);
+        if (name != "." && name != "..")
+            entry.names.insert(std::make_pair(folded(name), name));
+    }
+    closedir(handle);
+    isChanged_ = true;
+    return &entry;
+}
+
+/*----------------------------------------------------------------------------*/
+std::string DirectoryCache::folded(const std::string& name)
+{
+    string result(name);
+    for (string::iterator it = result.begin(); it != result.end(); ++it)
+        *it = static_cast<char>(tolower(static_cast<unsigned char>(*it)));
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+#endif
+
+/*-----------------------------------------------------------------------------+
+|   MappedFile methods                                                         |
++-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+MappedFile::MappedFile(const std::string& fileName)
+    : data_(0), size_(0)
+#ifdef _WIN32
+    , file_(INVALID_HANDLE_VALUE), mapping_(0)
+#else
+    , fd_(-1)
+#endif
+{
+#ifdef _WIN32
+    file_ = CreateFile(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file_ == INVALID_HANDLE_VALUE)
+        throw runtime_error("Could not open " + fileName);
+
+    size_ = GetFileSize(file_, NULL);
+    if (size_ == 0)
+        return;
+
+    mapping_ = CreateFileMapping(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping_ != 0)
+        data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+#else
+    fd_ = open(fileName.c_str(), O_RDONLY);
+    if (fd_ < 0)
+        throw runtime_error("Could not open " + fileName);
+
+    struct stat info;
+    if (fstat(fd_, &info) != 0 || info.st_size == 0)
+        return;
+
+    size_ = static_cast<size_t>(info.st_size);
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    // the whole file is scanned anyway, fault it in with one call
+    flags |= MAP_POPULATE;
+#endif
+    void* data = mmap(0, size_, PROT_READ, flags, fd_, 0);
+    if (data != MAP_FAILED)
+    {
+        madvise(data, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(data);
+    }
+#endif
+
+    if (data_ == 0)
+    {
+        close();
+        throw runtime_error("Could not map " + fileName);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+/*----------------------------------------------------------------------------*/
+void MappedFile::close()
+{
+#ifdef _WIN32
+    if (data_)
+        UnmapViewOfFile(data_);
+    if (mapping_)
+        CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE)
+        CloseHandle(file_);
+    mapping_ = 0;
+    file_ = INVALID_HANDLE_VALUE;
+#else
+    if (data_)
+        munmap(const_cast<char*>(data_), size_);
+    if (fd_ >= 0)
+        ::close(fd_);
+    fd_ = -1;
+#endif
+    data_ = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*-----------------------------------------------------------------------------+
+|   RegFileRegistry methods                                                    |
++-----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+RegFileRegistry::~RegFileRegistry()
+{
+    for (vector<MappedFile*>::iterator it = files_.begin(); it != files_.end(); ++it)
+        delete *it;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Maps an exported .reg file and indexes its keys. Files loaded earlier
+ * take precedence for values that appear in several files.
+ *
+ * @param fileName the file to load
+ * @param root     the root key ("HKEY_LOCAL_MACHINE\\") the key names of a
+ *                 Wine registry file are relative to
+ */
+void RegFileRegistry::load(const std::string& fileName, const char* root)
+{
+    MappedFile* file = new MappedFile(fileName);
+    files_.push_back(file);
+
+    const char* text = file->data();
+    size_t size = file->size();
+
+    // regedit 5.00 exports are UTF-16LE with a byte order mark
+    if (size >= 2 && static_cast<unsigned char>(text[0]) == 0xFF
+        && static_cast<unsigned char>(text[1]) == 0xFE)
+    {
+        decoded_.push_back(vector<char>());
+        vector<char>& narrow = decoded_.back();
+        appendNarrow(text + 2, (size - 2) / 2, narrow);
+        text = narrow.empty() ? "" : &narrow[0];
+        size = narrow.size();
+    }
+
+    // the mapped text has no terminating '\0'
+    bool isWine = size >= 13 && strncmp(text, "WINE REGISTRY", 13) == 0;
+    bool isRegedit = (size >= 8 && strncmp(text, "REGEDIT4", 8) == 0)
+        || (size >= 23 && strncmp(text, "Windows Registry Editor", 23) == 0);
+    if (!isWine && !isRegedit)
+        throw runtime_error(fileName + " is not an exported registry file");
+    if (!isWine)
+        root = "";
+    unsigned rootHash = hashKey(fnvBasis, root, strlen(root), false);
+
+    const char* end = text + size;
+    for (const char* line = text; line < end; )
+    {
+        const char* eol = static_cast<const char*>(memchr(line, '\n', end - line));
+        const char* next = eol ? eol + 1 : end;
+
+        // "[-key]" deletes a key, nothing to look up there; Wine adds a
+        // time stamp after the bracket
+        if (line[0] == '[' && next - line > 2 && line[1] != '-')
+        {
+            const char* bracket = next - 1;
+            while (bracket > line && *bracket != ']')
+                --bracket;
+            if (bracket > line + 1)
+            {
+                size_t nameLen = bracket - line - 1;
+                KeyEntry entry = { hashKey(rootHash, line + 1, nameLen, isWine),
+                                   root, line + 1, nameLen, isWine, next, end };
+                keys_.push_back(entry);
+            }
+        }
+        line = next;
+    }
+
+    // linear probing keeps the load order for equal keys, so the first
+    // file wins
+    size_t buckets = 16;
+    while (buckets < 2 * keys_.size())
+        buckets *= 2;
+    buckets_.assign(buckets, ~0u);
+    for (size_t i = 0; i < keys_.size(); ++i)
+    {
+        size_t bucket = keys_[i].hash & (buckets - 1);
+        while (buckets_[bucket] != ~0u)
+            bucket = (bucket + 1) & (buckets - 1);
+        buckets_[bucket] = static_cast<unsigned>(i);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+std::string RegFileRegistry::getString(const std::string& key,
+                                       const std::string& valueName) const
+{
+    string data = findValue(key, valueName);
+
+    if (!data.empty() && data[0] == '"')
+        return unquote(data);
+
+    // Wine writes REG_EXPAND_SZ as str(2):"..."
+    if (data.compare(0, 8, "str(2):\"") == 0)
+        return unquote(data.substr(7));
+
+    // REG_EXPAND_SZ: UTF-16LE bytes, written as hex(2):41,00,42,00,...
+    if (data.compare(0, 7, "hex(2):") == 0)
+    {
+        vector<char> bytes;
+        for (const char* p = data.c_str() + 7; *p != '\0'; )
+        {
+            char* next = 0;
+            unsigned long byte = strtoul(p, &next, 16);
+            if (next == p)
+                break;
+            bytes.push_back(static_cast<char>(byte));
+            p = next;
+            while (*p == ',' || isspace(static_cast<unsigned char>(*p)))
+                ++p;
+        }
+        vector<char> narrow;
+        appendNarrow(bytes.empty() ? "" : &bytes[0], bytes.size() / 2, narrow);
+        string result(narrow.begin(), narrow.end());
+        return result.substr(0, result.find('\0'));
+    }
+
+    throw runtime_error("Not a string: " + valueName);
+}
+
+/*----------------------------------------------------------------------------*/
+DWORD RegFileRegistry::getDword(const std::string& key,
+                                const std::string& valueName) const
+{
+    string data = findValue(key, valueName);
+    if (data.compare(0, 6, "dword:") != 0)
+        throw runtime_error("Not a DWORD: " + valueName);
+
+    return static_cast<DWORD>(strtoul(data.c_str() + 6, 0, 16));
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Finds the data of a value, i.e. the text after the '=' with continuation
+ * lines joined.
+ *
+ * Keys below HKLM\SOFTWARE are also searched below SOFTWARE\Wow6432Node,
+ * where a 64 bit system keeps the keys seen by 32 bit programs.
+ */
+std::string RegFileRegistry::findValue(const std::string& key,
+                                       const std::string& valueName) const
+{
+    string name = key;
+    string::size_type pos = name.find('\\');
+    string root = name.substr(0, pos);
+    if (root == "HKLM")
+        name.replace(0, pos, "HKEY_LOCAL_MACHINE");
+    else if (root == "HKCU")
+        name.replace(0, pos, "HKEY_CURRENT_USER");
+    else if (root == "HKCR")
+        name.replace(0, pos, "HKEY_CLASSES_ROOT");
+    else if (root == "HKU")
+        name.replace(0, pos, "HKEY_USERS");
+
+    const string software("HKEY_LOCAL_MACHINE\\SOFTWARE\\");
+    string candidates[2] = { name, "" };
+    if (_strnicmp(name.c_str(), software.c_str(), software.size()) == 0)
+        candidates[1] = software + "Wow6432Node\\" + name.substr(software.size());
+
+    bool keyFound = false;
+    for (size_t i = 0; i < 2 && !candidates[i].empty(); ++i)
+    {
+        const string& candidate = candidates[i];
+        unsigned hash = hashKey(fnvBasis, candidate.data(), candidate.size(), false);
+        size_t mask = buckets_.size() - 1;
+        for (size_t bucket = hash & mask; !buckets_.empty() && buckets_[bucket] != ~0u;
+             bucket = (bucket + 1) & mask)
+        {
+            const KeyEntry& entry = keys_[buckets_[bucket]];
+            if (entry.hash != hash || !isSameKey(entry, candidate))
+                continue;
+
+            keyFound = true;
+            string data;
+            if (findInKey(entry, valueName, data))
+                return data;
+        }
+    }
+
+    if (!keyFound)
+        throw runtime_error("Could not open " + key);
+    throw runtime_error("Could not read " + valueName);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Scans the value lines of one key for @a valueName ("" is the default
+ * value, written as @).
+ */
+bool RegFileRegistry::findInKey(const KeyEntry& entry,
+                                const std::string& valueName,
+                                std::string& data)
+{
+    for (const char* line = entry.body; line < entry.end; )
+    {
+        const char* eol = static_cast<const char*>(memchr(line, '\n', entry.end - line));
+        const char* next = eol ? eol + 1 : entry.end;
+        if (line[0] == '[')
+            break;
+
+        string name;
+        const char* p = line;
+        if (*p == '@')
+            ++p;
+        else if (*p == '"')
+        {
+            for (++p; p < next && *p != '"'; ++p)
+            {
+                if (*p == '\\' && p + 1 < next)
+                    ++p;
+                name += *p;
+            }
+            ++p;
+        }
+        else
+        {
+            line = next;
+            continue;
+        }
+
+        if (p < next && *p == '=' && name.size() == valueName.size()
+            && _strnicmp(name.c_str(), valueName.c_str(), name.size()) == 0)
+        {
+            // hex data continues on the next line after a trailing backslash
+            data.clear();
+            for (++p; ; )
+            {
+                const char* stop = next;
+                while (stop > p && isspace(static_cast<unsigned char>(stop[-1])))
+                    --stop;
+                bool continued = stop > p && stop[-1] == '\\';
+                data.append(p, continued ? stop - 1 : stop);
+                if (!continued || next >= entry.end)
+                    break;
+                p = next;
+                while (p < entry.end && (*p == ' ' || *p == '\t'))
+                    ++p;
+                eol = static_cast<const char*>(memchr(p, '\n', entry.end - p));
+                next = eol ? eol + 1 : entry.end;
+            }
+            return true;
+        }
+        line = next;
+    }
+    return false;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Compares the full name of an indexed key with @a key (case insensitive
+ * for ASCII letters, like hashKey).
+ */
+bool RegFileRegistry::isSameKey(const KeyEntry& entry, const std::string& key)
+{
+    size_t rootLen = strlen(entry.root);
+    if (key.size() < rootLen || _strnicmp(key.c_str(), entry.root, rootLen) != 0)
+        return false;
+
+    size_t j = rootLen;
+    for (size_t i = 0; i < entry.nameLen; ++i, ++j)
+    {
+        if (entry.isEscaped && entry.name[i] == '\\' && i + 1 < entry.nameLen)
+            ++i;
+        if (j >= key.size()
+            || tolower(static_cast<unsigned char>(entry.name[i]))
+               != tolower(static_cast<unsigned char>(key[j])))
+            return false;
+    }
+    return j == key.size();
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * FNV-1a hash of a key name, ignoring the case of ASCII letters (key names
+ * are practically always ASCII, and this is the hot loop of loading).
+ *
+ * @param hash      fnvBasis, or the hash of the preceding part of the name
+ * @param isEscaped the name doubles the backslashes (Wine)
+ */
+unsigned RegFileRegistry::hashKey(unsigned hash, const char* name, size_t size,
+                                  bool isEscaped)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (isEscaped && name[i] == '\\' && i + 1 < size)
+            ++i;
+        unsigned char c = static_cast<unsigned char>(name[i]);
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        hash ^= c;
+        hash *= fnvPrime;
+    }
+    return hash;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Removes the quotes and the backslash escapes of a string value.
+ */
+std::string RegFileRegistry::unquote(const std::string& data)
+{
+    string result;
+    result.reserve(data.size());
+    for (string::size_type i = 1; i < data.size() && data[i] != '"'; ++i)
+    {
+        if (data[i] == '\\' && i + 1 < data.size())
+            ++i;
+        result += data[i];
+    }
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * Converts UTF-16LE text to the narrow character set of the program (the
+ * ANSI code page on Windows, UTF-8 elsewhere) and appends it to @a out.
+ */
+void RegFileRegistry::appendNarrow(const char* utf16, size_t units,
+                                   std::vector<char>& out)
+{
+    if (units == 0)
+        return;
+
+#ifdef _WIN32
+    const wchar_t* wide = reinterpret_cast<const wchar_t*>(utf16);
+    int size = WideCharToMultiByte(CP_ACP, 0, wide, static_cast<int>(units),
+                                   NULL, 0, NULL, NULL);
+    size_t offset = out.size();
+    out.resize(offset + size);
+    WideCharToMultiByte(CP_ACP, 0, wide, static_cast<int>(units),
+                        &out[offset], size, NULL, NULL);
+#else
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(utf16);
+    size_t offset = out.size();
+    out.resize(offset + units);     // enough unless there are non-ASCII chars
+    char* dest = &out[offset];
+    size_t i = 0;
+    while (i < units)
+    {
+        // ASCII runs (the bulk of a registry export) four units at a time
+        while (i + 4 <= units && (p[2*i+1] | p[2*i+3] | p[2*i+5] | p[2*i+7]
+                                  | ((p[2*i] | p[2*i+2] | p[2*i+4] | p[2*i+6]) & 0x80)) == 0)
+        {
+            dest[0] = static_cast<char>(p[2*i]);
+            dest[1] = static_cast<char>(p[2*i+2]);
+            dest[2] = static_cast<char>(p[2*i+4]);
+            dest[3] = static_cast<char>(p[2*i+6]);
+            dest += 4;
+            i += 4;
+        }
+        if (i >= units)
+            break;
+
+        unsigned long c = p[2*i] | (p[2*i + 1] << 8);
+        ++i;
+        if (c < 0x80)
+        {
+            *dest++ = static_cast<char>(c);
+            continue;
+        }
+
+        if (c >= 0xD800 && c < 0xE000)
+        {
+            // a high surrogate followed by a low one, anything else
+            // becomes U+FFFD and the next unit is read on its own
+            unsigned long low = i < units ? p[2*i] | (p[2*i + 1] << 8) : 0;
+            if (c < 0xDC00 && low >= 0xDC00 && low < 0xE000)
+            {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                ++i;
+            }
+            else
+                c = 0xFFFD;
+        }
+
+        // multi byte sequences may outgrow the estimate
+        size_t used = dest - &out[0];
+        out.resize(out.size() + 3);
+        dest = &out[0] + used;
+
+        if (c < 0x800)
+        {
+            *dest++ = static_cast<char>(0xC0 | (c >> 6));
+            *dest++ = static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            *dest++ = static_cast<char>(0xE0 | (c >> 12));
+            *dest++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            *dest++ = static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            *dest++ = static_cast<char>(0xF0 | (c >> 18));
+            *dest++ = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+            *dest++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            *dest++ = static_cast<char>(0x80 | (c & 0x3F));
+        }
+    }
+    out.resize(dest - &out[0]);
+#endif
 }
 
 /*----------------------------------------------------------------------------*/
 
+#ifdef _WIN32
 /*-----------------------------------------------------------------------------+
 |   RegistryKey methods                                                        |
 +-----------------------------------------------------------------------------*/
@@ -985,6 +6092,7 @@ DWORD RegistryKey::getDword(const std::string& key,
 }
 
 /*----------------------------------------------------------------------------*/
+#endif
 
 
 /* eof */